@@ -5,18 +5,67 @@
 
 #include "atheme-compat.h"
 
+#include <time.h>
+
+#if defined(HAVE_LIBPCRE) || defined(HAVE_PCRE)
+#  include <pcre.h>
+#  define BADWORDS_HAVE_PCRE 1
+#endif
+
+/* Regex badwords are bounded in two ways: PCRE itself gives up after a
+ * fixed amount of backtracking, and every match is timed. A pattern that
+ * runs into the backtracking limit or takes longer than BADWORDS_SLOW_USEC
+ * for a single message earns a strike; after BADWORDS_MAX_STRIKES strikes
+ * it is disabled until someone re-adds it. Every BADWORDS_STRIKE_DECAY
+ * matches in a row that stay within both limits take a strike away, so
+ * occasional scheduling hiccups never add up to disabling a pattern.
+ */
+#define BADWORDS_MATCH_LIMIT            10000
+#define BADWORDS_RECURSION_LIMIT        500
+#define BADWORDS_SLOW_USEC              2000
+#define BADWORDS_MAX_STRIKES            5
+#define BADWORDS_STRIKE_DECAY           100
+
+#define BW_REGEX                        0x01U
+#define BW_DISABLED                     0x02U
+
 struct badword_ {
-	char *badword;
+	stringref badword;
 	time_t add_ts;
-	char *creator;
-	char *channel;
-	char *action;
+	stringref creator;
+	stringref channel;
+	stringref action;
+	unsigned int flags;
+#ifdef BADWORDS_HAVE_PCRE
+	pcre *re;
+	pcre_extra *re_study;
+	pcre_extra re_extra;
+#else
+	atheme_regex_t *re;
+#endif
+	unsigned long long match_usec;
+	unsigned int match_count;
+	unsigned int strikes;
+	unsigned int clean_matches;
 	mowgli_node_t node;
 };
 
 typedef struct badword_ badword_t;
 
+/* A named, network-wide list of badwords that channels can USE instead of
+ * keeping their own copy. Each entry is compiled once and shared by every
+ * subscribed channel; refcnt counts those channels.
+ */
+struct badword_set_ {
+	stringref name;
+	mowgli_list_t words;
+	unsigned int refcnt;
+};
+
+typedef struct badword_set_ badword_set_t;
+
 static mowgli_patricia_t **cs_set_cmdtree = NULL;
+static mowgli_patricia_t *badword_sets = NULL;
 
 static inline mowgli_list_t *
 badwords_list_of(mychan_t *mc)
@@ -35,66 +84,478 @@ badwords_list_of(mychan_t *mc)
 	return l;
 }
 
+static inline mowgli_list_t *
+badwords_sets_of(mychan_t *mc)
+{
+	mowgli_list_t *l;
+
+	return_val_if_fail(mc != NULL, NULL);
+
+	l = privatedata_get(mc, "badword:sets");
+	if (l != NULL)
+		return l;
+
+	l = mowgli_list_create();
+	privatedata_set(mc, "badword:sets", l);
+
+	return l;
+}
+
+/* Compiles a "/pattern/flags" badword once, so that on_channel_message()
+ * never has to. Returns false and sets errmsg if the pattern is unusable.
+ */
+static bool
+badword_compile(badword_t *bw, const char **errmsg)
+{
+	char *spec, *pattern, *end;
+	int flags = 0;
+
+	spec = sstrdup(bw->badword);
+	pattern = regex_extract(spec, &end, &flags);
+
+	if (pattern == NULL || *end != '\0')
+	{
+		sfree(spec);
+		*errmsg = "regular expressions must be given as /pattern/ or /pattern/i";
+		return false;
+	}
+
+#ifdef BADWORDS_HAVE_PCRE
+	int erroffset;
+
+	bw->re = pcre_compile(pattern, (flags & AREGEX_ICASE) ? PCRE_CASELESS : 0, errmsg, &erroffset, NULL);
+	sfree(spec);
+
+	if (bw->re == NULL)
+		return false;
+
+	const char *studyerr = NULL;
+
+	memset(&bw->re_extra, 0, sizeof bw->re_extra);
+
+	if ((bw->re_study = pcre_study(bw->re, 0, &studyerr)) != NULL)
+		bw->re_extra = *bw->re_study;
+
+	bw->re_extra.flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+	bw->re_extra.match_limit = BADWORDS_MATCH_LIMIT;
+	bw->re_extra.match_limit_recursion = BADWORDS_RECURSION_LIMIT;
+#else
+	bw->re = regex_create(pattern, flags);
+	sfree(spec);
+
+	if (bw->re == NULL)
+	{
+		*errmsg = "the pattern failed to compile";
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+static void
+badword_destroy(badword_t *bw)
+{
+#ifdef BADWORDS_HAVE_PCRE
+	if (bw->re_study != NULL)
+		pcre_free_study(bw->re_study);
+	if (bw->re != NULL)
+		pcre_free(bw->re);
+#else
+	if (bw->re != NULL)
+		regex_destroy(bw->re);
+#endif
+
+	strshare_unref(bw->creator);
+	strshare_unref(bw->channel);
+	strshare_unref(bw->badword);
+	strshare_unref(bw->action);
+	sfree(bw);
+}
+
+static bool
+badword_valid_action(const char *action)
+{
+	if (!strcasecmp("KICK", action) || !strcasecmp("KICKBAN", action) || !strcasecmp("WARN", action) ||
+	    !strcasecmp("BAN", action))
+		return true;
+
+	return !strcasecmp("QUIET", action) && ircd != NULL && strchr(ircd->ban_like_modes, 'q');
+}
+
+/* Creates a badword owned by a channel or set. Returns NULL and sets errmsg
+ * if it is a regex that does not compile.
+ */
+static badword_t *
+badword_create(const char *word, time_t add_ts, const char *creator, const char *owner, const char *action,
+               bool regex, const char **errmsg)
+{
+	badword_t *bw = scalloc(1, sizeof(badword_t));
+
+	bw->badword = strshare_get(word);
+	bw->add_ts = add_ts;
+	bw->creator = strshare_get(creator);
+	bw->channel = strshare_get(owner);
+	bw->action = strshare_get(action);
+
+	if (regex)
+	{
+		bw->flags |= BW_REGEX;
+
+		if (!badword_compile(bw, errmsg))
+		{
+			badword_destroy(bw);
+			return NULL;
+		}
+	}
+
+	return bw;
+}
+
+static badword_t *
+badword_find(mowgli_list_t *l, const char *word)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, l->head)
+	{
+		badword_t *bw = n->data;
+
+		if (!irccasecmp(bw->badword, word))
+			return bw;
+	}
+
+	return NULL;
+}
+
+static void
+badword_list_clear(mowgli_list_t *l)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+	{
+		badword_t *bw = n->data;
+
+		mowgli_node_delete(&bw->node, l);
+		badword_destroy(bw);
+	}
+}
+
+static badword_set_t *
+badword_set_find(const char *name)
+{
+	return mowgli_patricia_retrieve(badword_sets, name);
+}
+
+static badword_set_t *
+badword_set_create(const char *name)
+{
+	badword_set_t *set = scalloc(1, sizeof(badword_set_t));
+
+	set->name = strshare_get(name);
+	mowgli_patricia_add(badword_sets, set->name, set);
+
+	return set;
+}
+
+static void
+badword_set_free(const char *key, void *data, void *privdata)
+{
+	badword_set_t *set = data;
+
+	badword_list_clear(&set->words);
+	strshare_unref(set->name);
+	sfree(set);
+}
+
+static void
+badword_set_destroy(badword_set_t *set)
+{
+	mowgli_patricia_delete(badword_sets, set->name);
+	badword_set_free(set->name, set, NULL);
+}
+
+static bool
+badword_set_subscribe(mychan_t *mc, badword_set_t *set)
+{
+	mowgli_list_t *l = badwords_sets_of(mc);
+
+	if (mowgli_node_find(set, l) != NULL)
+		return false;
+
+	mowgli_node_add(set, mowgli_node_create(), l);
+	set->refcnt++;
+
+	return true;
+}
+
+static bool
+badword_set_unsubscribe(mychan_t *mc, badword_set_t *set)
+{
+	mowgli_list_t *l = privatedata_get(mc, "badword:sets");
+	mowgli_node_t *n;
+
+	if (l == NULL || (n = mowgli_node_find(set, l)) == NULL)
+		return false;
+
+	mowgli_node_delete(n, l);
+	mowgli_node_free(n);
+	set->refcnt--;
+
+	return true;
+}
+
+static void
+badword_sets_clear(mychan_t *mc)
+{
+	mowgli_list_t *l;
+	mowgli_node_t *n, *tn;
+
+	if ((l = privatedata_get(mc, "badword:sets")) == NULL)
+		return;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+	{
+		badword_set_t *set = n->data;
+
+		set->refcnt--;
+		mowgli_node_delete(n, l);
+		mowgli_node_free(n);
+	}
+
+	privatedata_delete(mc, "badword:sets");
+	mowgli_list_free(l);
+}
+
+static void
+badword_strike(badword_t *bw, const char *why)
+{
+	bw->clean_matches = 0;
+
+	if (++bw->strikes < BADWORDS_MAX_STRIKES)
+		return;
+
+	bw->flags |= BW_DISABLED;
+
+	slog(LG_INFO, "BADWORDS: disabled regex \2%s\2 on \2%s\2 (%s, %u matches in %llu usec)",
+	     bw->badword, bw->channel, why, bw->match_count, bw->match_usec);
+}
+
+static bool
+badword_match_regex(badword_t *bw, const char *msg)
+{
+	struct timespec start, end;
+	long long usec;
+	bool matched, struck = false;
+
+	if (bw->re == NULL || (bw->flags & BW_DISABLED))
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef BADWORDS_HAVE_PCRE
+	int rc = pcre_exec(bw->re, &bw->re_extra, msg, (int) strlen(msg), 0, 0, NULL, 0);
+
+	matched = (rc >= 0);
+
+	if (rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT)
+	{
+		badword_strike(bw, "match limit exceeded");
+		struck = true;
+	}
+#else
+	matched = regex_match(bw->re, (char *) msg);
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	usec = (long long) (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+	bw->match_usec += (unsigned long long) usec;
+	bw->match_count++;
+
+	if (usec > BADWORDS_SLOW_USEC && !(bw->flags & BW_DISABLED))
+		badword_strike(bw, "too slow");
+	else if (!struck && bw->strikes != 0 && ++bw->clean_matches >= BADWORDS_STRIKE_DECAY)
+	{
+		bw->strikes--;
+		bw->clean_matches = 0;
+	}
+
+	return matched;
+}
+
+static inline bool
+badword_matches(badword_t *bw, const char *msg)
+{
+	if (bw->flags & BW_REGEX)
+		return badword_match_regex(bw, msg);
+
+	return !match(bw->badword, msg);
+}
+
 static void
 write_badword_db(database_handle_t *db)
 {
 	mowgli_node_t *n;
 	mychan_t *mc;
+	badword_set_t *set;
 	mowgli_patricia_iteration_state_t state;
 	mowgli_list_t *l;
 
-	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	MOWGLI_PATRICIA_FOREACH(set, &state, badword_sets)
 	{
-		l = badwords_list_of(mc);
-
-		if (l == NULL)
-			return;
-
-		MOWGLI_ITER_FOREACH(n, l->head)
+		MOWGLI_ITER_FOREACH(n, set->words.head)
 		{
 			badword_t *bw = n->data;
 
-			db_start_row(db, "BW");
+			db_start_row(db, "BWS");
+			db_write_word(db, set->name);
 			db_write_word(db, bw->badword);
 			db_write_time(db, bw->add_ts);
 			db_write_word(db, bw->creator);
-			db_write_word(db, bw->channel);
 			db_write_word(db, bw->action);
+			if (bw->flags & BW_REGEX)
+				db_write_word(db, "REGEX");
 			db_commit_row(db);
 		}
 	}
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	{
+		if ((l = privatedata_get(mc, "badword:list")) != NULL)
+		{
+			MOWGLI_ITER_FOREACH(n, l->head)
+			{
+				badword_t *bw = n->data;
+
+				db_start_row(db, "BW");
+				db_write_word(db, bw->badword);
+				db_write_time(db, bw->add_ts);
+				db_write_word(db, bw->creator);
+				db_write_word(db, bw->channel);
+				db_write_word(db, bw->action);
+				if (bw->flags & BW_REGEX)
+					db_write_word(db, "REGEX");
+				db_commit_row(db);
+			}
+		}
+
+		if ((l = privatedata_get(mc, "badword:sets")) != NULL)
+		{
+			MOWGLI_ITER_FOREACH(n, l->head)
+			{
+				set = n->data;
+
+				db_start_row(db, "BWU");
+				db_write_word(db, mc->name);
+				db_write_word(db, set->name);
+				db_commit_row(db);
+			}
+		}
+	}
+}
+
+/* A regex that no longer compiles is kept so that it survives the next
+ * save, but it will never match.
+ */
+static void
+badword_load_regex(badword_t *bw)
+{
+	const char *errmsg = NULL;
+
+	bw->flags |= BW_REGEX;
+
+	if (!badword_compile(bw, &errmsg))
+	{
+		slog(LG_ERROR, "BADWORDS: cannot compile regex %s for %s: %s", bw->badword, bw->channel, errmsg);
+		bw->flags |= BW_DISABLED;
+	}
 }
 
 static void
 db_h_bw(database_handle_t *db, const char *type)
 {
 	mychan_t *mc;
-	mowgli_patricia_iteration_state_t state;
-	mowgli_list_t *l;
+	badword_t *bw;
 
 	const char *badword = db_sread_word(db);
 	time_t add_ts = db_sread_time(db);
 	const char *creator = db_sread_word(db);
 	const char *channel = db_sread_word(db);
 	const char *action = db_sread_word(db);
+	const char *bwtype = db_read_word(db);
+	bool regex = bwtype != NULL && !strcasecmp(bwtype, "REGEX");
 
-	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
-	{
-		if (irccasecmp(mc->name, channel))
-			continue;
+	if ((mc = mychan_find(channel)) == NULL)
+		return;
+
+	bw = badword_create(badword, add_ts, creator, mc->name, action, false, NULL);
+
+	if (regex)
+		badword_load_regex(bw);
 
-		l = badwords_list_of(mc);
+	mowgli_node_add(bw, &bw->node, badwords_list_of(mc));
+}
+
+static void
+db_h_bws(database_handle_t *db, const char *type)
+{
+	badword_set_t *set;
+	badword_t *bw;
+
+	const char *setname = db_sread_word(db);
+	const char *badword = db_sread_word(db);
+	time_t add_ts = db_sread_time(db);
+	const char *creator = db_sread_word(db);
+	const char *action = db_sread_word(db);
+	const char *bwtype = db_read_word(db);
+	bool regex = bwtype != NULL && !strcasecmp(bwtype, "REGEX");
+
+	if ((set = badword_set_find(setname)) == NULL)
+		set = badword_set_create(setname);
+
+	bw = badword_create(badword, add_ts, creator, set->name, action, false, NULL);
+
+	if (regex)
+		badword_load_regex(bw);
+
+	mowgli_node_add(bw, &bw->node, &set->words);
+}
+
+static void
+db_h_bwu(database_handle_t *db, const char *type)
+{
+	mychan_t *mc;
+	badword_set_t *set;
+
+	const char *channel = db_sread_word(db);
+	const char *setname = db_sread_word(db);
+
+	if ((mc = mychan_find(channel)) == NULL)
+		return;
+
+	if ((set = badword_set_find(setname)) == NULL)
+		set = badword_set_create(setname);
+
+	badword_set_subscribe(mc, set);
+}
 
-		badword_t *bw = smalloc(sizeof(badword_t));
+static badword_t *
+badword_list_match(mowgli_list_t *l, const char *msg)
+{
+	mowgli_node_t *n;
 
-		bw->badword = sstrdup(badword);
-		bw->add_ts = add_ts;
-		bw->creator = sstrdup(creator);
-		bw->channel = sstrdup(channel);
-		bw->action = sstrdup(action);
+	MOWGLI_ITER_FOREACH(n, l->head)
+	{
+		badword_t *bw = n->data;
 
-		mowgli_node_add(bw, &bw->node, l);
+		if (badword_matches(bw, msg))
+			return bw;
 	}
+
+	return NULL;
 }
 
 static void
@@ -102,7 +563,7 @@ on_channel_message(hook_cmessage_data_t *data)
 {
 	badword_t *bw;
 	mowgli_node_t *n;
-	mowgli_list_t *l;
+	mowgli_list_t *l, *sets;
 
 	mychan_t *mc = mychan_from(data->c);
 
@@ -112,81 +573,132 @@ on_channel_message(hook_cmessage_data_t *data)
 	if (metadata_find(mc, "blockbadwords") == NULL)
 		return;
 
-	l = badwords_list_of(mc);
-	if (MOWGLI_LIST_LENGTH(l) == 0)
+	l = privatedata_get(mc, "badword:list");
+	sets = privatedata_get(mc, "badword:sets");
+	if ((l == NULL || MOWGLI_LIST_LENGTH(l) == 0) && (sets == NULL || MOWGLI_LIST_LENGTH(sets) == 0))
 		return;
 
 	char *kickstring = "Foul language is prohibited here.";
 
 	if (data != NULL && data->msg != NULL)
 	{
-		MOWGLI_ITER_FOREACH(n, l->head)
+		chanuser_t *cu;
+
+		cu = chanuser_find(data->c, data->u);
+		if (cu == NULL)
+			return;
+		if ((metadata_find(mc, "blockbadwordsops") != NULL) && ((CSTATUS_OP | CSTATUS_PROTECT | CSTATUS_OWNER) & cu->modes))
+			return;
+
+		bw = (l != NULL) ? badword_list_match(l, data->msg) : NULL;
+
+		if (bw == NULL && sets != NULL)
 		{
-			bw = n->data;
-			chanuser_t *cu;
-			cu = chanuser_find(data->c, data->u);
-			if (cu == NULL)
+			MOWGLI_ITER_FOREACH(n, sets->head)
+			{
+				badword_set_t *set = n->data;
+
+				if ((bw = badword_list_match(&set->words, data->msg)) != NULL)
+					break;
+			}
+		}
+
+		if (bw != NULL)
+		{
+			if (!strcasecmp("KICKBAN", bw->action))
+			{
+				char hostbuf[BUFSIZE];
+
+				hostbuf[0] = '\0';
+
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
+
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
+				chanban_add(data->c, hostbuf, 'b');
+				kick(chansvs.me->me, data->c, data->u, kickstring);
+				return;
+			}
+			else if (!strcasecmp("KICK", bw->action))
+			{
+				kick(chansvs.me->me, data->c, data->u, kickstring);
 				return;
-			if ((metadata_find(mc, "blockbadwordsops") != NULL) && ((CSTATUS_OP | CSTATUS_PROTECT | CSTATUS_OWNER) & cu->modes))
+			}
+			else if (!strcasecmp("WARN", bw->action))
+			{
+				notice(chansvs.nick, data->u->nick, "Foul language is prohibited on %s.", data->c->name);
 				return;
+			}
+			else if (!strcasecmp("QUIET", bw->action))
+			{
+				char hostbuf[BUFSIZE];
+
+				hostbuf[0] = '\0';
+
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
 
-			if (!match(bw->badword, data->msg))
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'q', hostbuf);
+				chanban_add(data->c, hostbuf, 'q');
+				return;
+			}
+			else if (!strcasecmp("BAN", bw->action))
 			{
-				if (!strcasecmp("KICKBAN", bw->action))
-				{
-					char hostbuf[BUFSIZE];
-
-					hostbuf[0] = '\0';
-
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
-
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
-					chanban_add(data->c, hostbuf, 'b');
-					kick(chansvs.me->me, data->c, data->u, kickstring);
-					return;
-				}
-				else if (!strcasecmp("KICK", bw->action))
-				{
-					kick(chansvs.me->me, data->c, data->u, kickstring);
-					return;
-				}
-				else if (!strcasecmp("WARN", bw->action))
-				{
-					notice(chansvs.nick, data->u->nick, "Foul language is prohibited on %s.", data->c->name);
-					return;
-				}
-				else if (!strcasecmp("QUIET", bw->action))
-				{
-					char hostbuf[BUFSIZE];
-
-					hostbuf[0] = '\0';
-
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
-
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'q', hostbuf);
-					chanban_add(data->c, hostbuf, 'q');
-					return;
-				}
-				else if (!strcasecmp("BAN", bw->action))
-				{
-					char hostbuf[BUFSIZE];
-
-					hostbuf[0] = '\0';
-
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
-
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
-					chanban_add(data->c, hostbuf, 'b');
-					return;
-				}
+				char hostbuf[BUFSIZE];
+
+				hostbuf[0] = '\0';
+
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
+
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
+				chanban_add(data->c, hostbuf, 'b');
+				return;
 			}
 		}
 	}
 }
 
+static void
+on_channel_drop(mychan_t *mc)
+{
+	mowgli_list_t *l;
+
+	if ((l = privatedata_get(mc, "badword:list")) != NULL)
+	{
+		badword_list_clear(l);
+		privatedata_delete(mc, "badword:list");
+		mowgli_list_free(l);
+	}
+
+	badword_sets_clear(mc);
+}
+
+static void
+badword_list_show(sourceinfo_t *si, mowgli_list_t *l)
+{
+	mowgli_node_t *n;
+	char buf[BUFSIZE];
+	struct tm tm;
+
+	MOWGLI_ITER_FOREACH(n, l->head)
+	{
+		badword_t *bw = n->data;
+
+		tm = *localtime(&bw->add_ts);
+		strftime(buf, BUFSIZE, TIME_FORMAT, &tm);
+
+		if (!(bw->flags & BW_REGEX))
+			command_success_nodata(si, _("Word: \2%s\2, Action: \2%s\2 (%s - %s)"),
+			                             bw->badword, bw->action, bw->creator, buf);
+		else
+			command_success_nodata(si, _("Regex: \2%s\2, Action: \2%s\2 (%s - %s) [%s%u matches, %llu usec]"),
+			                             bw->badword, bw->action, bw->creator, buf,
+			                             (bw->flags & BW_DISABLED) ? "DISABLED, " : "",
+			                             bw->match_count, bw->match_usec);
+	}
+}
+
 static void
 cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 {
@@ -194,15 +706,17 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 	char *command = parv[1];
 	char *word = parv[2];
 	char *action = parv[3];
+	char *type = parv[4];
 	mychan_t *mc;
-	mowgli_node_t *n, *tn;
+	mowgli_node_t *n;
 	badword_t *bw;
+	badword_set_t *set;
 	mowgli_list_t *l;
 
 	if (!channel || !command)
 	{
 		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "SET BADWORDS");
-		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD|DEL|LIST [badword] [action]"));
+		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD|DEL|USE|UNUSE|LIST [badword|set] [action]"));
 		return;
 	}
 
@@ -220,7 +734,7 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 		if (!word || !action)
 		{
 			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDS");
-			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD <badword> <action>"));
+			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD <badword> <action> [REGEX]"));
 			return;
 		}
 
@@ -230,35 +744,38 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 			return;
 		}
 
-		if (!strcasecmp("KICK", action) || !strcasecmp("KICKBAN", action) || !strcasecmp("WARN", action) ||
-		    !strcasecmp("BAN", action) || (!strcasecmp("QUIET", action) && ircd != NULL &&
-		    strchr(ircd->ban_like_modes, 'q')))
+		if (type != NULL && strcasecmp("REGEX", type))
 		{
-			if (l != NULL)
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "BADWORDS");
+			command_fail(si, fault_badparams, _("Syntax: BADWORDS <#channel> ADD <badword> <action> [REGEX]"));
+			return;
+		}
+
+		if (badword_valid_action(action))
+		{
+			const char *errmsg = NULL;
+
+			if (badword_find(l, word) != NULL)
 			{
-				MOWGLI_ITER_FOREACH(n, l->head)
-				{
-					bw = n->data;
-
-					if (!irccasecmp(bw->badword, word))
-					{
-						command_success_nodata(si, _("\2%s\2 has already been entered "
-						                             "into the bad word list."), word);
-						return;
-					}
-				}
+				command_success_nodata(si, _("\2%s\2 has already been entered "
+				                             "into the bad word list."), word);
+				return;
+			}
+
+			bw = badword_create(word, CURRTIME, get_source_name(si), mc->name, action, type != NULL, &errmsg);
+
+			if (bw == NULL)
+			{
+				command_fail(si, fault_badparams, _("\2%s\2 is not a valid regular expression: %s"),
+				                                   word, errmsg);
+				return;
 			}
 
-			bw = smalloc(sizeof(badword_t));
-			bw->add_ts = CURRTIME;;
-			bw->creator = sstrdup(get_source_name(si));
-			bw->channel = sstrdup(mc->name);
-			bw->badword = sstrdup(word);
-			bw->action = sstrdup(action);
 			mowgli_node_add(bw, &bw->node, l);
 
 			command_success_nodata(si, _("You have added \2%s\2 as a bad word."), word);
-			logcommand(si, CMDLOG_SET, "BADWORDS:ADD: \2%s\2 \2%s\2 \2%s\2", channel, word, action);
+			logcommand(si, CMDLOG_SET, "BADWORDS:ADD: \2%s\2 \2%s\2 \2%s\2%s", channel, word, action,
+			           (bw->flags & BW_REGEX) ? " (regex)" : "");
 		}
 		else
 		{
@@ -288,33 +805,63 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 			return;
 		}
 
-		MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+		if ((bw = badword_find(l, word)) != NULL)
 		{
-			bw = n->data;
+			logcommand(si, CMDLOG_SET, "BADWORDS:DEL: \2%s\2 \2%s\2", mc->name, bw->badword);
+			command_success_nodata(si, _("Bad word \2%s\2 has been deleted."), bw->badword);
 
-			if (!irccasecmp(bw->badword, word))
-			{
-				logcommand(si, CMDLOG_SET, "BADWORDS:DEL: \2%s\2 \2%s\2", mc->name, bw->badword);
-				command_success_nodata(si, _("Bad word \2%s\2 has been deleted."), bw->badword);
+			mowgli_node_delete(&bw->node, l);
+			badword_destroy(bw);
 
-				mowgli_node_delete(&bw->node, l);
+			return;
+		}
 
-				sfree(bw->creator);
-				sfree(bw->channel);
-				sfree(bw->badword);
-				sfree(bw->action);
-				sfree(bw);
+		command_success_nodata(si, _("Word \2%s\2 not found in bad word database."), word);
+	}
+	else if (!strcasecmp("USE", command) || !strcasecmp("UNUSE", command))
+	{
+		bool use = !strcasecmp("USE", command);
 
-				return;
-			}
+		if (!word)
+		{
+			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDS");
+			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> USE|UNUSE <set>"));
+			return;
 		}
 
-		command_success_nodata(si, _("Word \2%s\2 not found in bad word database."), word);
+		if (!chanacs_source_has_flag(mc, si, CA_SET))
+		{
+			command_fail(si, fault_noprivs, STR_NOT_AUTHORIZED);
+			return;
+		}
+
+		if ((set = badword_set_find(word)) == NULL)
+		{
+			command_fail(si, fault_nosuch_target, _("There is no badword set named \2%s\2."), word);
+			return;
+		}
+
+		if (use && !badword_set_subscribe(mc, set))
+		{
+			command_fail(si, fault_nochange, _("\2%s\2 already uses the badword set \2%s\2."), mc->name, set->name);
+			return;
+		}
+		else if (!use && !badword_set_unsubscribe(mc, set))
+		{
+			command_fail(si, fault_nochange, _("\2%s\2 does not use the badword set \2%s\2."), mc->name, set->name);
+			return;
+		}
+
+		if (use)
+			command_success_nodata(si, _("\2%s\2 now uses the badword set \2%s\2."), mc->name, set->name);
+		else
+			command_success_nodata(si, _("\2%s\2 no longer uses the badword set \2%s\2."), mc->name, set->name);
+
+		logcommand(si, CMDLOG_SET, "BADWORDS:%s: \2%s\2 \2%s\2", use ? "USE" : "UNUSE", mc->name, set->name);
 	}
 	else if (!strcasecmp("LIST", command))
 	{
-		char buf[BUFSIZE];
-		struct tm tm;
+		mowgli_list_t *sets = privatedata_get(mc, "badword:sets");
 
 		if (!chanacs_source_has_flag(mc, si, CA_ACLVIEW))
 		{
@@ -328,14 +875,17 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 			return;
 		}
 
-		MOWGLI_ITER_FOREACH(n, l->head)
+		badword_list_show(si, l);
+
+		if (sets != NULL)
 		{
-			bw = n->data;
+			MOWGLI_ITER_FOREACH(n, sets->head)
+			{
+				set = n->data;
 
-			tm = *localtime(&bw->add_ts);
-			strftime(buf, BUFSIZE, TIME_FORMAT, &tm);
-			command_success_nodata(si, _("Word: \2%s\2, Action: \2%s\2 (%s - %s)"),
-			                             bw->badword, bw->action, bw->creator, buf);
+				command_success_nodata(si, _("Set: \2%s\2 (%zu entries)"), set->name,
+				                             MOWGLI_LIST_LENGTH(&set->words));
+			}
 		}
 
 		command_success_nodata(si, "End of list.");
@@ -344,7 +894,168 @@ cs_cmd_badwords(sourceinfo_t *si, int parc, char *parv[])
 	else
 	{
 		command_fail(si, fault_needmoreparams, STR_INVALID_PARAMS, "BADWORDS");
-		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD|DEL|LIST [badword] [action]"));
+		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDS <#channel> ADD|DEL|USE|UNUSE|LIST [badword|set] [action]"));
+		return;
+	}
+}
+
+static void
+cs_cmd_badwordset(sourceinfo_t *si, int parc, char *parv[])
+{
+	char *command = parv[0];
+	char *setname = parv[1];
+	char *word = parv[2];
+	char *action = parv[3];
+	char *type = parv[4];
+	badword_set_t *set;
+	badword_t *bw;
+
+	if (!command)
+	{
+		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDSET");
+		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDSET ADD|DEL|DROP|LIST [set] [badword] [action]"));
+		return;
+	}
+
+	set = setname != NULL ? badword_set_find(setname) : NULL;
+
+	if (!strcasecmp("ADD", command))
+	{
+		const char *errmsg = NULL;
+
+		if (!setname || !word || !action)
+		{
+			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDSET");
+			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDSET ADD <set> <badword> <action> [REGEX]"));
+			return;
+		}
+
+		if (type != NULL && strcasecmp("REGEX", type))
+		{
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "BADWORDSET");
+			command_fail(si, fault_badparams, _("Syntax: BADWORDSET ADD <set> <badword> <action> [REGEX]"));
+			return;
+		}
+
+		if (!badword_valid_action(action))
+		{
+			command_fail(si, fault_badparams, _("Invalid action given."));
+			return;
+		}
+
+		if (set != NULL && badword_find(&set->words, word) != NULL)
+		{
+			command_success_nodata(si, _("\2%s\2 has already been entered into the badword set \2%s\2."),
+			                             word, set->name);
+			return;
+		}
+
+		bw = badword_create(word, CURRTIME, get_source_name(si), set != NULL ? set->name : setname, action,
+		                    type != NULL, &errmsg);
+
+		if (bw == NULL)
+		{
+			command_fail(si, fault_badparams, _("\2%s\2 is not a valid regular expression: %s"), word, errmsg);
+			return;
+		}
+
+		if (set == NULL)
+			set = badword_set_create(setname);
+
+		mowgli_node_add(bw, &bw->node, &set->words);
+
+		command_success_nodata(si, _("You have added \2%s\2 to the badword set \2%s\2."), word, set->name);
+		logcommand(si, CMDLOG_ADMIN, "BADWORDSET:ADD: \2%s\2 \2%s\2 \2%s\2%s", set->name, word, action,
+		           (bw->flags & BW_REGEX) ? " (regex)" : "");
+	}
+	else if (!strcasecmp("DEL", command))
+	{
+		if (!setname || !word)
+		{
+			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDSET");
+			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDSET DEL <set> <badword>"));
+			return;
+		}
+
+		if (set == NULL || (bw = badword_find(&set->words, word)) == NULL)
+		{
+			command_fail(si, fault_nosuch_target, _("Word \2%s\2 not found in badword set \2%s\2."),
+			                                       word, setname);
+			return;
+		}
+
+		logcommand(si, CMDLOG_ADMIN, "BADWORDSET:DEL: \2%s\2 \2%s\2", set->name, bw->badword);
+		command_success_nodata(si, _("Bad word \2%s\2 has been deleted from the badword set \2%s\2."),
+		                             bw->badword, set->name);
+
+		mowgli_node_delete(&bw->node, &set->words);
+		badword_destroy(bw);
+	}
+	else if (!strcasecmp("DROP", command))
+	{
+		if (!setname)
+		{
+			command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "BADWORDSET");
+			command_fail(si, fault_needmoreparams, _("Syntax: BADWORDSET DROP <set>"));
+			return;
+		}
+
+		if (set == NULL)
+		{
+			command_fail(si, fault_nosuch_target, _("There is no badword set named \2%s\2."), setname);
+			return;
+		}
+
+		if (set->refcnt != 0)
+		{
+			mychan_t *mc;
+			mowgli_list_t *l;
+			mowgli_patricia_iteration_state_t state;
+
+			command_fail(si, fault_nochange, _("The badword set \2%s\2 is still used by \2%u\2 channel(s):"),
+			                                  set->name, set->refcnt);
+
+			MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+			{
+				if ((l = privatedata_get(mc, "badword:sets")) != NULL && mowgli_node_find(set, l) != NULL)
+					command_fail(si, fault_nochange, "  %s", mc->name);
+			}
+
+			return;
+		}
+
+		logcommand(si, CMDLOG_ADMIN, "BADWORDSET:DROP: \2%s\2", set->name);
+		command_success_nodata(si, _("The badword set \2%s\2 has been dropped."), setname);
+
+		badword_set_destroy(set);
+	}
+	else if (!strcasecmp("LIST", command))
+	{
+		mowgli_patricia_iteration_state_t state;
+
+		if (setname == NULL)
+		{
+			MOWGLI_PATRICIA_FOREACH(set, &state, badword_sets)
+			{
+				command_success_nodata(si, _("Set: \2%s\2 (%zu entries, used by %u channel(s))"), set->name,
+				                             MOWGLI_LIST_LENGTH(&set->words), set->refcnt);
+			}
+		}
+		else if (set == NULL)
+		{
+			command_fail(si, fault_nosuch_target, _("There is no badword set named \2%s\2."), setname);
+			return;
+		}
+		else
+			badword_list_show(si, &set->words);
+
+		command_success_nodata(si, "End of list.");
+		logcommand(si, CMDLOG_GET, "BADWORDSET:LIST: \2%s\2", setname != NULL ? setname : "*");
+	}
+	else
+	{
+		command_fail(si, fault_needmoreparams, STR_INVALID_PARAMS, "BADWORDSET");
+		command_fail(si, fault_needmoreparams, _("Syntax: BADWORDSET ADD|DEL|DROP|LIST [set] [badword] [action]"));
 		return;
 	}
 }
@@ -471,11 +1182,20 @@ static command_t cs_badwords = {
 	.name           = "BADWORDS",
 	.desc           = N_("Manage the list of channel bad words."),
 	.access         = AC_AUTHENTICATED,
-	.maxparc        = 4,
+	.maxparc        = 5,
 	.cmd            = &cs_cmd_badwords,
 	.help           = { .path = "contrib/badwords" },
 };
 
+static command_t cs_badwordset = {
+	.name           = "BADWORDSET",
+	.desc           = N_("Manage network-wide bad word sets."),
+	.access         = PRIV_CHAN_ADMIN,
+	.maxparc        = 5,
+	.cmd            = &cs_cmd_badwordset,
+	.help           = { .path = "contrib/badwordset" },
+};
+
 static command_t cs_set_blockbadwords = {
 	.name           = "BLOCKBADWORDS",
 	.desc           = N_("Set whether users can say badwords in channel or not."),
@@ -506,14 +1226,28 @@ mod_init(module_t *const restrict m)
 		return;
 	}
 
+	/* Pick up the sets a previous instance handed over on reload; the
+	 * channels' subscriptions to them survived in their privatedata.
+	 */
+	if ((badword_sets = privatedata_get(chansvs.me->me, "badword:sets")) != NULL)
+		privatedata_delete(chansvs.me->me, "badword:sets");
+	else
+		badword_sets = mowgli_patricia_create(irccasecanon);
+
 	hook_add_event("channel_message");
 	hook_add_channel_message(on_channel_message);
 
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(on_channel_drop);
+
 	hook_add_db_write(write_badword_db);
 
 	db_register_type_handler("BW", db_h_bw);
+	db_register_type_handler("BWS", db_h_bws);
+	db_register_type_handler("BWU", db_h_bwu);
 
 	service_named_bind_command("chanserv", &cs_badwords);
+	service_named_bind_command("chanserv", &cs_badwordset);
 	command_add(&cs_set_blockbadwords, *cs_set_cmdtree);
 	command_add(&cs_set_blockbadwordsops, *cs_set_cmdtree);
 }
@@ -521,12 +1255,33 @@ mod_init(module_t *const restrict m)
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mychan_t *mc;
+	mowgli_patricia_iteration_state_t state;
+
 	hook_del_channel_message(on_channel_message);
+	hook_del_channel_drop(on_channel_drop);
 	hook_del_db_write(write_badword_db);
 
 	db_unregister_type_handler("BW");
+	db_unregister_type_handler("BWS");
+	db_unregister_type_handler("BWU");
+
+	/* The database is not read again on reload, so the sets are handed
+	 * to the next instance like the channels' own lists are.
+	 */
+	if (intent == MODULE_UNLOAD_INTENT_RELOAD)
+		privatedata_set(chansvs.me->me, "badword:sets", badword_sets);
+	else
+	{
+		/* Channels must not be left pointing at the sets freed below. */
+		MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+			badword_sets_clear(mc);
+
+		mowgli_patricia_destroy(badword_sets, &badword_set_free, NULL);
+	}
 
 	service_named_unbind_command("chanserv", &cs_badwords);
+	service_named_unbind_command("chanserv", &cs_badwordset);
 	command_delete(&cs_set_blockbadwords, *cs_set_cmdtree);
 	command_delete(&cs_set_blockbadwordsops, *cs_set_cmdtree);
 }
@@ -14,8 +14,28 @@
  * interconnection, the channels.dot file contains also
  * information about social networks.
  *
- * Eventually Graphtastical will dump other graph datafiles
- * too.
+ * Setting graphtastical_format in the general block to "json"
+ * or "binary" writes the same graphs as a newline-delimited
+ * JSON edge list (channels.ndjson) or in a compact binary
+ * format (channels.bin, described below) instead, both of
+ * which are much quicker for other tools to read.
+ *
+ * Full dumps are written every graphtastical_full_interval.
+ * In between, channels.delta.dot (and so on) is rewritten
+ * with the edges added and removed since the last full dump,
+ * so the full dump plus the latest delta give the current
+ * graph. The delta is removed when a new full dump replaces
+ * the one it was relative to.
+ *
+ * With graphtastical_overlap enabled, overlap.dot links
+ * channels by the number of members they share instead of
+ * listing every membership, which stays readable on large
+ * networks. Pairs sharing fewer than
+ * graphtastical_overlap_min_shared members are left out, and
+ * an edge is only kept if it is one of the
+ * graphtastical_overlap_top heaviest of either channel.
+ * Computing it cannot be split up, so it is only written when
+ * graphtastical_fork is also set.
  *
  * To make a file from the data dumped by Graphtastical,
  * the following commands will do:
@@ -36,156 +56,1372 @@
 
 #include "atheme-compat.h"
 
-static mowgli_eventloop_timer_t *channels_timer = NULL;
-static mowgli_eventloop_timer_t *uchannels_timer = NULL;
+/* output is collected in this many bytes before each write(2) */
+#define GRAPH_BUFSIZE		(64 * 1024)
+
+/* rough number of nodes and edges written per event loop iteration */
+#define GRAPH_STEP_BUDGET	20000
+
+/* a delta with more changes than this is replaced by a full dump */
+#define GRAPH_DELTA_MAX		100000
+
+typedef struct graph_dump_ graph_dump_t;
+typedef struct graph_format_ graph_format_t;
+
+/* export from a forked child instead of in slices from the event loop */
+static bool graph_fork = false;
+
+/* one of the graph_formats below, by name */
+static char *graph_format_name = NULL;
+
+/* how often a full dump is written; deltas are written in between */
+static unsigned int graph_full_interval = 0;
+
+struct graph_format_ {
+	const char *name;
+	const char *ext;
+	void (*begin)(graph_dump_t *dump);
+	void (*node)(graph_dump_t *dump, const char *id);
+	void (*edge)(graph_dump_t *dump, const char *from, const char *to);
+	void (*change)(graph_dump_t *dump, const char *from, const char *to, bool added);
+	void (*weighted)(graph_dump_t *dump, const char *from, const char *to, unsigned int weight);
+	void (*end)(graph_dump_t *dump);
+};
+
+/* the latest state of an edge that changed since the last full dump */
+typedef struct {
+	bool added;
+	char *to;
+	char from[];
+} graph_change_t;
+
+struct graph_dump_ {
+	const char *name;
+	mowgli_patricia_t **tree;
+	unsigned int (*write_node)(graph_dump_t *dump, void *data);
+
+	/* graphs that are computed up front are written in one go by this */
+	void (*write_all)(graph_dump_t *dump);
+	bool *enabled;
+	bool refused;
+
+	mowgli_eventloop_timer_t *timer;
+	mowgli_eventloop_timer_t *step_timer;
+
+	/* edge changes seen by the hooks, keyed by "from to" */
+	mowgli_patricia_t *delta;
+	bool delta_dirty;
+	time_t next_full;
+
+	bool running;
+	pid_t pid;
+	bool full;
+	const graph_format_t *format;
+	char path[BUFSIZE];
+	char tmppath[BUFSIZE];
+	mowgli_patricia_iteration_state_t state;
+	FILE *f;
+	int error;
+
+	/* binary format: IDs handed out to the strings written so far */
+	mowgli_patricia_t *strings;
+	unsigned int next_string;
+
+	char *buf;
+	size_t len;
+};
 
-/* write channels.dot */
 static void
-write_channels_dot_file(void *arg)
+graph_flush(graph_dump_t *dump)
 {
-	mychan_t *mc;
-	chanacs_t *ca;
-	mowgli_node_t *tn;
-	FILE *f;
-	int errno1, was_errored = 0;
-	mowgli_patricia_iteration_state_t state;
-	int root = 1;
-	mychan_t *pmc;
+	if (dump->len != 0 && fwrite(dump->buf, 1, dump->len, dump->f) != dump->len && !dump->error)
+		dump->error = errno;
 
-	errno = 0;
+	dump->len = 0;
+}
 
-	/* write to a temporary file first */
-	if (!(f = fopen(DATADIR "/channels.dot.new", "w")))
+static void
+graph_write(graph_dump_t *dump, const char *data, size_t len)
+{
+	if (dump->len + len > GRAPH_BUFSIZE)
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot create channels.dot.new: %s", strerror(errno1));
-		return;
+		graph_flush(dump);
+
+		if (len > GRAPH_BUFSIZE)
+		{
+			if (fwrite(data, 1, len, dump->f) != len && !dump->error)
+				dump->error = errno;
+			return;
+		}
 	}
 
-	fprintf(f, "graph channels {\n");
-	fprintf(f, "edge [color=blue len=7.5 fontname=\"Verdana\" fontsize=8]\n");
-	fprintf(f, "node [fontname=\"Verdana\" fontsize=8]\n");
+	memcpy(dump->buf + dump->len, data, len);
+	dump->len += len;
+}
+
+static inline void
+graph_puts(graph_dump_t *dump, const char *str)
+{
+	graph_write(dump, str, strlen(str));
+}
+
+/*
+ * writes a DOT ID. Inside a quoted string DOT only knows \" as an
+ * escape; every other backslash is taken literally, so only quotes are
+ * escaped. A trailing backslash would still swallow the closing quote,
+ * which is why "foo\" is written as "foo\ " instead.
+ */
+static void
+graph_put_id(graph_dump_t *dump, const char *id)
+{
+	const char *p;
+	size_t len;
 
-	slog(LG_DEBUG, "graphtastical: dumping mychans");
+	graph_write(dump, "\"", 1);
 
-	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	while ((p = strchr(id, '"')) != NULL)
 	{
-		fprintf(f, "\"%s\"", mc->name);
+		graph_write(dump, id, p - id);
+		graph_write(dump, "\\\"", 2);
+		id = p + 1;
+	}
 
-		if (!root)
-			fprintf(f, "-- \"%s\"", pmc->name);
+	len = strlen(id);
+	graph_write(dump, id, len);
 
-		pmc = mc;
+	if (len > 0 && id[len - 1] == '\\')
+		graph_write(dump, " ", 1);
 
-		fprintf(f, "[fontname=\"Verdana\" fontsize=8]\n");
+	graph_write(dump, "\"", 1);
+}
 
-		MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
-		{
-			ca = (chanacs_t *)tn->data;
+static void
+dot_begin(graph_dump_t *dump)
+{
+	graph_puts(dump, "graph ");
+	graph_puts(dump, dump->name);
+	graph_puts(dump, " {\n"
+		"edge [color=blue len=7.5 fontname=\"Verdana\" fontsize=8]\n"
+		"node [fontname=\"Verdana\" fontsize=8]\n");
+}
 
-			if (ca->level & CA_AKICK)
-				continue;
+static void
+dot_node(graph_dump_t *dump, const char *id)
+{
+	graph_put_id(dump, id);
+	graph_write(dump, "\n", 1);
+}
+
+static void
+dot_edge(graph_dump_t *dump, const char *from, const char *to)
+{
+	graph_put_id(dump, from);
+	graph_write(dump, " -- ", 4);
+	graph_put_id(dump, to);
+	graph_write(dump, "\n", 1);
+}
+
+static void
+dot_change(graph_dump_t *dump, const char *from, const char *to, bool added)
+{
+	graph_put_id(dump, from);
+	graph_write(dump, " -- ", 4);
+	graph_put_id(dump, to);
+	graph_puts(dump, added ? " [delta=add]\n" : " [delta=remove]\n");
+}
+
+static void
+dot_weighted(graph_dump_t *dump, const char *from, const char *to, unsigned int weight)
+{
+	char attr[32];
+
+	graph_put_id(dump, from);
+	graph_write(dump, " -- ", 4);
+	graph_put_id(dump, to);
+	graph_write(dump, attr, snprintf(attr, sizeof attr, " [weight=%u]\n", weight));
+}
 
-			fprintf(f, "\"%s\" -- \"%s\" [fontname=\"Verdana\" fontsize=8]\n", ca->entity ? ca->entity->name : ca->host, mc->name);
+static void
+dot_end(graph_dump_t *dump)
+{
+	graph_puts(dump, "}\n");
+}
+
+/* writes a JSON string; bytes above 0x7f are passed through as they are */
+static void
+graph_put_json_string(graph_dump_t *dump, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *p;
+	char esc[6];
+
+	graph_write(dump, "\"", 1);
+
+	for (p = str; *p != '\0'; p++)
+	{
+		unsigned char ch = (unsigned char) *p;
+
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
+
+		graph_write(dump, str, p - str);
+		str = p + 1;
+
+		if (ch == '"' || ch == '\\')
+		{
+			esc[0] = '\\';
+			esc[1] = ch;
+			graph_write(dump, esc, 2);
+			continue;
 		}
+
+		memcpy(esc, "\\u00", 4);
+		esc[4] = hex[ch >> 4];
+		esc[5] = hex[ch & 0xf];
+		graph_write(dump, esc, 6);
 	}
 
-	fprintf(f, "}\n");
+	graph_puts(dump, str);
+	graph_write(dump, "\"", 1);
+}
+
+static void
+json_node(graph_dump_t *dump, const char *id)
+{
+	graph_puts(dump, "{\"node\":");
+	graph_put_json_string(dump, id);
+	graph_write(dump, "}\n", 2);
+}
+
+static void
+json_edge(graph_dump_t *dump, const char *from, const char *to)
+{
+	graph_puts(dump, "{\"from\":");
+	graph_put_json_string(dump, from);
+	graph_puts(dump, ",\"to\":");
+	graph_put_json_string(dump, to);
+	graph_write(dump, "}\n", 2);
+}
+
+static void
+json_change(graph_dump_t *dump, const char *from, const char *to, bool added)
+{
+	graph_puts(dump, "{\"from\":");
+	graph_put_json_string(dump, from);
+	graph_puts(dump, ",\"to\":");
+	graph_put_json_string(dump, to);
+	graph_puts(dump, added ? ",\"delta\":\"add\"}\n" : ",\"delta\":\"remove\"}\n");
+}
+
+static void
+json_weighted(graph_dump_t *dump, const char *from, const char *to, unsigned int weight)
+{
+	char attr[32];
+
+	graph_puts(dump, "{\"from\":");
+	graph_put_json_string(dump, from);
+	graph_puts(dump, ",\"to\":");
+	graph_put_json_string(dump, to);
+	graph_write(dump, attr, snprintf(attr, sizeof attr, ",\"weight\":%u}\n", weight));
+}
+
+/*
+ * The binary format is a 5-byte header, "AGR" followed by the graph type
+ * ('c' for channels, 'u' for uchannels, 'o' for overlap) and the format
+ * version (1), and
+ * then a stream of records, each starting with a tag byte:
+ *
+ *   'S' <len> <bytes>  defines the next string; IDs count up from 0
+ *   'N' <id>           a node
+ *   'E' <from> <to>    an edge between two nodes
+ *   'R' <from> <to>    an edge that was removed (delta files only)
+ *   'W' <from> <to> <weight>  an edge with a weight (overlap only)
+ *   'Z'                end of graph
+ *
+ * Lengths and IDs are unsigned LEB128 varints. Every string is defined
+ * once, before the first record that refers to it.
+ */
+static void
+graph_put_varint(graph_dump_t *dump, unsigned int value)
+{
+	char bytes[5];
+	size_t len = 0;
 
-	was_errored = ferror(f);
-	was_errored |= fclose(f);
-	if (was_errored)
+	do
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot write to channels.dot.new: %s", strerror(errno1));
-		return;
-	}
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+
+		if (value != 0)
+			bytes[len] |= 0x80;
+
+		len++;
+	} while (value != 0);
+
+	graph_write(dump, bytes, len);
+}
+
+static unsigned int
+graph_intern(graph_dump_t *dump, const char *str)
+{
+	void *known = mowgli_patricia_retrieve(dump->strings, str);
+	unsigned int id;
+	size_t len;
+
+	/* IDs are stored off by one, as NULL means not found */
+	if (known != NULL)
+		return (unsigned int)(uintptr_t) known - 1;
+
+	id = dump->next_string++;
+	mowgli_patricia_add(dump->strings, str, (void *)(uintptr_t)(id + 1));
+
+	len = strlen(str);
+	graph_write(dump, "S", 1);
+	graph_put_varint(dump, len);
+	graph_write(dump, str, len);
+
+	return id;
+}
+
+static void
+binary_begin(graph_dump_t *dump)
+{
+	char header[5] = { 'A', 'G', 'R', dump->name[0], 1 };
+
+	dump->strings = mowgli_patricia_create(NULL);
+	dump->next_string = 0;
+
+	graph_write(dump, header, sizeof header);
+}
+
+static void
+binary_node(graph_dump_t *dump, const char *id)
+{
+	unsigned int node = graph_intern(dump, id);
+
+	graph_write(dump, "N", 1);
+	graph_put_varint(dump, node);
+}
+
+static void
+binary_edge(graph_dump_t *dump, const char *from, const char *to)
+{
+	unsigned int a = graph_intern(dump, from);
+	unsigned int b = graph_intern(dump, to);
+
+	graph_write(dump, "E", 1);
+	graph_put_varint(dump, a);
+	graph_put_varint(dump, b);
+}
+
+static void
+binary_change(graph_dump_t *dump, const char *from, const char *to, bool added)
+{
+	unsigned int a = graph_intern(dump, from);
+	unsigned int b = graph_intern(dump, to);
+
+	graph_write(dump, added ? "E" : "R", 1);
+	graph_put_varint(dump, a);
+	graph_put_varint(dump, b);
+}
+
+static void
+binary_weighted(graph_dump_t *dump, const char *from, const char *to, unsigned int weight)
+{
+	unsigned int a = graph_intern(dump, from);
+	unsigned int b = graph_intern(dump, to);
+
+	graph_write(dump, "W", 1);
+	graph_put_varint(dump, a);
+	graph_put_varint(dump, b);
+	graph_put_varint(dump, weight);
+}
+
+static void
+binary_end(graph_dump_t *dump)
+{
+	graph_write(dump, "Z", 1);
+}
+
+static const graph_format_t graph_formats[] = {
+	{ "dot",	"dot",		dot_begin,	dot_node,	dot_edge,	dot_change,	dot_weighted,	dot_end },
+	{ "json",	"ndjson",	NULL,		json_node,	json_edge,	json_change,	json_weighted,	NULL },
+	{ "binary",	"bin",		binary_begin,	binary_node,	binary_edge,	binary_change,	binary_weighted,	binary_end },
+};
+
+static const graph_format_t *
+graph_format_find(const char *name)
+{
+	size_t i;
+
+	if (name == NULL)
+		return &graph_formats[0];
+
+	for (i = 0; i < sizeof graph_formats / sizeof graph_formats[0]; i++)
+		if (!strcasecmp(graph_formats[i].name, name))
+			return &graph_formats[i];
+
+	return NULL;
+}
+
+static inline void
+graph_put_node(graph_dump_t *dump, const char *id)
+{
+	dump->format->node(dump, id);
+}
+
+static inline void
+graph_put_edge(graph_dump_t *dump, const char *from, const char *to)
+{
+	dump->format->edge(dump, from, to);
+}
+
+/*
+ * channels: registered channels and the entities on their access lists.
+ * Channels are not linked to each other; the old writer had code for a
+ * "#chan" -- "#previous" chain, but its first-channel flag was never
+ * cleared, so that edge never reached the file and is not written here.
+ */
+static unsigned int
+write_channels_node(graph_dump_t *dump, void *data)
+{
+	mychan_t *mc = data;
+	chanacs_t *ca;
+	mowgli_node_t *tn;
+	unsigned int written = 1;
+
+	graph_put_node(dump, mc->name);
 
-	/* now, replace the old database with the new one, using an atomic rename */
-	if ((srename(DATADIR "/channels.dot.new", DATADIR "/channels.dot")) < 0)
+	MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot rename channels.dot.new to channels.dot: %s", strerror(errno1));
-		return;
+		ca = (chanacs_t *)tn->data;
+
+		if (ca->level & CA_AKICK)
+			continue;
+
+		graph_put_edge(dump, ca->entity ? ca->entity->name : ca->host, mc->name);
+		written++;
 	}
+
+	return written;
 }
 
-/* write uchannels.dot */
-static void
-write_uchannels_dot_file(void *arg)
+/* uchannels: channels and the users currently in them */
+static unsigned int
+write_uchannels_node(graph_dump_t *dump, void *data)
 {
-	channel_t *c;
+	channel_t *c = data;
 	chanuser_t *cu;
 	mowgli_node_t *tn;
-	FILE *f;
-	int errno1, was_errored = 0;
-	mowgli_patricia_iteration_state_t state;
+	unsigned int written = 1;
 
-	errno = 0;
+	graph_put_node(dump, c->name);
 
-	/* write to a temporary file first */
-	if (!(f = fopen(DATADIR "/uchannels.dot.new", "w")))
+	MOWGLI_ITER_FOREACH(tn, c->members.head)
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot create channels.dot.new: %s", strerror(errno1));
-		return;
+		cu = (chanuser_t *)tn->data;
+
+		graph_put_edge(dump, cu->user->nick, c->name);
+		written++;
+	}
+
+	return written;
+}
+
+/*
+ * overlap: channels linked by how many members they share. Users are
+ * numbered in one pass over userlist, which leaves each channel with a
+ * sorted array of member numbers; every pair of channels that share a
+ * member is then weighed by intersecting their two arrays.
+ */
+typedef struct {
+	unsigned int a, b;
+	unsigned int weight;
+} graph_overlap_edge_t;
+
+static bool graph_overlap = false;
+static unsigned int graph_overlap_min_shared = 0;
+static unsigned int graph_overlap_top = 0;
+
+static unsigned int
+graph_intersect(const unsigned int *a, unsigned int alen, const unsigned int *b, unsigned int blen)
+{
+	const unsigned int *tmp;
+	unsigned int i = 0, j = 0, lo, hi, mid, shared = 0;
+
+	if (alen > blen)
+	{
+		tmp = a, a = b, b = tmp;
+		i = alen, alen = blen, blen = i;
+		i = 0;
+	}
+
+	/* binary search the bigger array when a plain merge would mostly skip */
+	if (alen * 16 < blen)
+	{
+		for (i = 0; i < alen; i++)
+		{
+			lo = j;
+			hi = blen;
+
+			while (lo < hi)
+			{
+				mid = lo + (hi - lo) / 2;
+
+				if (b[mid] < a[i])
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo < blen && b[lo] == a[i])
+			{
+				shared++;
+				lo++;
+			}
+
+			j = lo;
+		}
+
+		return shared;
+	}
+
+	while (i < alen && j < blen)
+	{
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else
+		{
+			shared++;
+			i++;
+			j++;
+		}
 	}
 
-	fprintf(f, "graph uchannels {\n");
-	fprintf(f, "edge [color=blue len=7.5 fontname=\"Verdana\" fontsize=8]\n");
-	fprintf(f, "node [fontname=\"Verdana\" fontsize=8]\n");
+	return shared;
+}
+
+static int
+graph_overlap_cmp(const void *p1, const void *p2)
+{
+	const graph_overlap_edge_t *e1 = p1, *e2 = p2;
+
+	if (e1->weight != e2->weight)
+		return e1->weight < e2->weight ? 1 : -1;
+	if (e1->a != e2->a)
+		return e1->a < e2->a ? -1 : 1;
+	if (e1->b != e2->b)
+		return e1->b < e2->b ? -1 : 1;
+
+	return 0;
+}
+
+static void
+write_overlap_graph(graph_dump_t *dump)
+{
+	mowgli_patricia_t *index;
+	mowgli_patricia_iteration_state_t state;
+	mowgli_node_t *n;
+	channel_t *c, **chans;
+	chanuser_t *cu;
+	user_t *u;
+	graph_overlap_edge_t *edges = NULL;
+	size_t nedges = 0, maxedges = 0, k;
+	unsigned int *chan_off, *chan_user, *user_off, *user_chan, *fill, *rank;
+	unsigned int nchans = 0, nusers = 0, nmembers = 0, maxmembers = 0;
+	unsigned int min_shared = graph_overlap_min_shared ? graph_overlap_min_shared : 1;
+	unsigned int a, b, i, j, uid, asize, bsize, weight;
+	void *found;
 
-	slog(LG_DEBUG, "graphtastical: dumping chans");
+	index = mowgli_patricia_create(irccasecanon);
+	chans = smalloc(sizeof *chans * (mowgli_patricia_size(chanlist) + 1));
 
+	/* channel numbers are stored off by one, as NULL means not found */
 	MOWGLI_PATRICIA_FOREACH(c, &state, chanlist)
 	{
-		fprintf(f, "\"%s\"", c->name);
+		chans[nchans++] = c;
+		mowgli_patricia_add(index, c->name, (void *)(uintptr_t) nchans);
+		maxmembers += MOWGLI_LIST_LENGTH(&c->members);
+	}
+
+	chan_off = scalloc(nchans + 1, sizeof *chan_off);
+	user_off = smalloc(sizeof *user_off * (mowgli_patricia_size(userlist) + 1));
+	user_chan = smalloc(sizeof *user_chan * (maxmembers + 1));
+
+	/* number the users and note which channels each of them is in */
+	MOWGLI_PATRICIA_FOREACH(u, &state, userlist)
+	{
+		if (is_internal_client(u))
+			continue;
 
-		fprintf(f, "[fontname=\"Verdana\" fontsize=8]\n");
+		user_off[nusers++] = nmembers;
 
-		MOWGLI_ITER_FOREACH(tn, c->members.head)
+		MOWGLI_ITER_FOREACH(n, u->channels.head)
 		{
-			cu = (chanuser_t *)tn->data;
+			cu = n->data;
+
+			if (nmembers == maxmembers || (found = mowgli_patricia_retrieve(index, cu->chan->name)) == NULL)
+				continue;
 
-			fprintf(f, "\"%s\" -- \"%s\" [fontname=\"Verdana\" fontsize=8]\n", cu->user->nick, c->name);
+			a = (unsigned int)(uintptr_t) found - 1;
+			user_chan[nmembers++] = a;
+			chan_off[a + 1]++;
 		}
 	}
 
-	fprintf(f, "}\n");
+	user_off[nusers] = nmembers;
+
+	for (a = 0; a < nchans; a++)
+		chan_off[a + 1] += chan_off[a];
+
+	/* users are visited in order, so every member array comes out sorted */
+	chan_user = smalloc(sizeof *chan_user * (nmembers + 1));
+	fill = smalloc(sizeof *fill * (nchans + 1));
+	memcpy(fill, chan_off, sizeof *fill * (nchans + 1));
+
+	for (uid = 0; uid < nusers; uid++)
+		for (i = user_off[uid]; i < user_off[uid + 1]; i++)
+			chan_user[fill[user_chan[i]]++] = uid;
+
+	/* weigh each pair of channels with a member in common, once */
+	memset(fill, 0, sizeof *fill * (nchans + 1));
 
-	was_errored = ferror(f);
-	was_errored |= fclose(f);
-	if (was_errored)
+	for (a = 0; a < nchans; a++)
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot write to uchannels.dot.new: %s", strerror(errno1));
-		return;
+		asize = chan_off[a + 1] - chan_off[a];
+
+		if (asize < min_shared)
+			continue;
+
+		for (i = chan_off[a]; i < chan_off[a + 1]; i++)
+		{
+			uid = chan_user[i];
+
+			for (j = user_off[uid]; j < user_off[uid + 1]; j++)
+			{
+				b = user_chan[j];
+
+				if (b <= a || fill[b] == a + 1)
+					continue;
+
+				fill[b] = a + 1;
+				bsize = chan_off[b + 1] - chan_off[b];
+
+				if (bsize < min_shared)
+					continue;
+
+				weight = graph_intersect(chan_user + chan_off[a], asize, chan_user + chan_off[b], bsize);
+
+				if (weight < min_shared)
+					continue;
+
+				if (nedges == maxedges)
+				{
+					maxedges = maxedges ? maxedges * 2 : 1024;
+					edges = srealloc(edges, sizeof *edges * maxedges);
+				}
+
+				edges[nedges].a = a;
+				edges[nedges].b = b;
+				edges[nedges].weight = weight;
+				nedges++;
+			}
+		}
 	}
 
-	/* now, replace the old database with the new one, using an atomic rename */
-	if ((srename(DATADIR "/uchannels.dot.new", DATADIR "/uchannels.dot")) < 0)
+	/* keep an edge if it is among the heaviest few of either channel */
+	if (nedges != 0)
+		qsort(edges, nedges, sizeof *edges, graph_overlap_cmp);
+	rank = scalloc(nchans + 1, sizeof *rank);
+
+	for (k = 0; k < nedges; k++)
 	{
-		errno1 = errno;
-		slog(LG_ERROR, "graphtastical: cannot rename uchannels.dot.new to uchannels.dot: %s", strerror(errno1));
-		return;
+		a = edges[k].a;
+		b = edges[k].b;
+
+		if (graph_overlap_top == 0 || rank[a] < graph_overlap_top || rank[b] < graph_overlap_top)
+			dump->format->weighted(dump, chans[a]->name, chans[b]->name, edges[k].weight);
+
+		rank[a]++;
+		rank[b]++;
 	}
+
+	slog(LG_DEBUG, "graphtastical: %u channels and %u users share %zu overlaps", nchans, nusers, nedges);
+
+	mowgli_patricia_destroy(index, NULL, NULL);
+	sfree(chans);
+	sfree(chan_off);
+	sfree(chan_user);
+	sfree(user_off);
+	sfree(user_chan);
+	sfree(fill);
+	sfree(rank);
+	sfree(edges);
 }
 
+static graph_dump_t channels_dump = {
+	.name = "channels",
+	.tree = &mclist,
+	.write_node = write_channels_node,
+};
+
+static graph_dump_t uchannels_dump = {
+	.name = "uchannels",
+	.tree = &chanlist,
+	.write_node = write_uchannels_node,
+};
+
+static graph_dump_t overlap_dump = {
+	.name = "overlap",
+	.tree = &chanlist,
+	.write_all = write_overlap_graph,
+	.enabled = &graph_overlap,
+};
+
+/* reasons a dump can fail; a forked export uses them as its exit status */
+#define GRAPH_FAIL_CREATE	1
+#define GRAPH_FAIL_WRITE	2
+#define GRAPH_FAIL_RENAME	3
+
 static void
-mod_init(module_t *const restrict m)
+graph_dump_report(graph_dump_t *dump, int failure, int err)
 {
-	write_channels_dot_file(NULL);
-	write_uchannels_dot_file(NULL);
+	const char *reason = err ? strerror(err) : "export process failed";
 
-	channels_timer = mowgli_timer_add(base_eventloop, "write_channels_dot_file", write_channels_dot_file, NULL, 60);
-	uchannels_timer = mowgli_timer_add(base_eventloop, "write_uchannels_dot_file", write_uchannels_dot_file, NULL, 60);
+	switch (failure)
+	{
+		case GRAPH_FAIL_CREATE:
+			slog(LG_ERROR, "graphtastical: cannot create %s: %s", dump->tmppath, reason);
+			break;
+		case GRAPH_FAIL_WRITE:
+			slog(LG_ERROR, "graphtastical: cannot write to %s: %s", dump->tmppath, reason);
+			break;
+		case GRAPH_FAIL_RENAME:
+			slog(LG_ERROR, "graphtastical: cannot rename %s to %s: %s", dump->tmppath, dump->path, reason);
+			break;
+		default:
+			slog(LG_ERROR, "graphtastical: %s export failed with status %d", dump->name, failure);
+			break;
+	}
 }
 
 static void
-mod_deinit(const module_unload_intent_t intent)
+graph_dump_release(graph_dump_t *dump)
+{
+	if (dump->strings != NULL)
+	{
+		mowgli_patricia_destroy(dump->strings, NULL, NULL);
+		dump->strings = NULL;
+	}
+}
+
+static int
+graph_dump_open(graph_dump_t *dump, const graph_format_t *format, const char *suffix)
 {
-	mowgli_timer_destroy(base_eventloop, channels_timer);
-	mowgli_timer_destroy(base_eventloop, uchannels_timer);
+	dump->format = format;
+	dump->full = *suffix == '\0';
+	snprintf(dump->path, sizeof dump->path, "%s/%s%s.%s", DATADIR, dump->name, suffix, format->ext);
+	snprintf(dump->tmppath, sizeof dump->tmppath, "%s.new", dump->path);
+
+	errno = 0;
+
+	/* write to a temporary file first */
+	if (!(dump->f = fopen(dump->tmppath, "w")))
+	{
+		dump->error = errno;
+		return GRAPH_FAIL_CREATE;
+	}
+
+	if (dump->buf == NULL)
+		dump->buf = smalloc(GRAPH_BUFSIZE);
+
+	dump->len = 0;
+	dump->error = 0;
+
+	if (format->begin != NULL)
+		format->begin(dump);
+
+	return 0;
+}
+
+/*
+ * Writes whole nodes until about budget nodes and edges are out, or all of
+ * them if budget is 0. Returns true once the end of the tree is reached.
+ */
+static bool
+graph_dump_write(graph_dump_t *dump, unsigned int budget)
+{
+	unsigned int written;
+	void *data;
+
+	while ((data = mowgli_patricia_foreach_cur(*dump->tree, &dump->state)) != NULL)
+	{
+		written = dump->write_node(dump, data);
+		mowgli_patricia_foreach_next(*dump->tree, &dump->state);
+
+		if (budget == 0)
+			continue;
+
+		if (written >= budget)
+			return mowgli_patricia_foreach_cur(*dump->tree, &dump->state) == NULL;
+
+		budget -= written;
+	}
+
+	return true;
+}
+
+static int
+graph_dump_close(graph_dump_t *dump)
+{
+	int was_errored;
+
+	if (dump->format->end != NULL)
+		dump->format->end(dump);
+
+	graph_flush(dump);
+	graph_dump_release(dump);
+
+	was_errored = ferror(dump->f) || dump->error;
+	if (fclose(dump->f) != 0 && !dump->error)
+		dump->error = errno;
+	dump->f = NULL;
+
+	if (was_errored || dump->error)
+	{
+		unlink(dump->tmppath);
+		return GRAPH_FAIL_WRITE;
+	}
+
+	/* now, replace the old file with the new one, using an atomic rename */
+	if ((srename(dump->tmppath, dump->path)) < 0)
+	{
+		dump->error = errno;
+		return GRAPH_FAIL_RENAME;
+	}
+
+	/* the old delta is relative to the full dump just replaced */
+	if (dump->full)
+	{
+		char deltapath[BUFSIZE];
+
+		snprintf(deltapath, sizeof deltapath, "%s/%s.delta.%s", DATADIR, dump->name, dump->format->ext);
+		unlink(deltapath);
+	}
+
+	return 0;
+}
+
+static void
+graph_dump_abort(graph_dump_t *dump)
+{
+	/* a forked export finishes on its own */
+	if (!dump->running || dump->pid != 0)
+		return;
+
+	if (dump->step_timer != NULL)
+	{
+		mowgli_timer_destroy(base_eventloop, dump->step_timer);
+		dump->step_timer = NULL;
+	}
+
+	fclose(dump->f);
+	unlink(dump->tmppath);
+	graph_dump_release(dump);
+
+	dump->f = NULL;
+	dump->len = 0;
+	dump->running = false;
+}
+
+/* writes the next slice of the dump, then yields to the event loop until it is done */
+static void
+graph_dump_step(void *arg)
+{
+	graph_dump_t *dump = arg;
+	int failure;
+
+	dump->step_timer = NULL;
+
+	if (!graph_dump_write(dump, GRAPH_STEP_BUDGET))
+	{
+		dump->step_timer = mowgli_timer_add_once(base_eventloop, "graph_dump_step", graph_dump_step, dump, 0);
+		return;
+	}
+
+	dump->running = false;
+
+	if ((failure = graph_dump_close(dump)) != 0)
+		graph_dump_report(dump, failure, dump->error);
+}
+
+static void
+graph_dump_reaped(pid_t pid, int status, void *data)
+{
+	graph_dump_t *dump = data;
+
+	dump->pid = 0;
+	dump->running = false;
+
+	if (!WIFEXITED(status))
+		slog(LG_ERROR, "graphtastical: %s export process was killed by signal %d", dump->name, WTERMSIG(status));
+	else if (WEXITSTATUS(status) != 0)
+		graph_dump_report(dump, WEXITSTATUS(status), 0);
+	else
+		slog(LG_DEBUG, "graphtastical: %s export process finished", dump->name);
+}
+
+/*
+ * The child walks its copy-on-write image of the trees in one go, so the
+ * only cost to services itself is the fork.
+ */
+static void
+graph_dump_fork(graph_dump_t *dump, const graph_format_t *format)
+{
+	pid_t pid;
+	int errno1, failure;
+
+	switch ((pid = fork()))
+	{
+		case -1:
+			errno1 = errno;
+			slog(LG_ERROR, "graphtastical: cannot fork to export %s: %s", dump->name, strerror(errno1));
+			return;
+		case 0:
+			connection_close_all_fds();
+
+			if ((failure = graph_dump_open(dump, format, "")) == 0)
+			{
+				if (dump->write_all != NULL)
+					dump->write_all(dump);
+				else
+				{
+					mowgli_patricia_foreach_start(*dump->tree, &dump->state);
+					graph_dump_write(dump, 0);
+				}
+
+				failure = graph_dump_close(dump);
+			}
+
+			_exit(failure);
+		default:
+			dump->pid = pid;
+			dump->running = true;
+			childproc_add(pid, "graphtastical", graph_dump_reaped, dump);
+			break;
+	}
+}
+
+static void
+graph_change_free(const char *key, void *data, void *privdata)
+{
+	sfree(data);
+}
+
+static void
+graph_delta_clear(graph_dump_t *dump)
+{
+	mowgli_patricia_destroy(dump->delta, graph_change_free, NULL);
+	dump->delta = mowgli_patricia_create(NULL);
+	dump->delta_dirty = false;
+}
+
+/*
+ * Remembers the latest state of an edge. A dump that is still being
+ * written may or may not have caught the edge, so the change is kept
+ * even if it undoes an earlier one.
+ */
+static void
+graph_delta_record(graph_dump_t *dump, const char *from, const char *to, bool added)
+{
+	graph_change_t *change;
+	char key[BUFSIZE];
+	size_t fromlen, tolen;
+
+	snprintf(key, sizeof key, "%s %s", from, to);
+	dump->delta_dirty = true;
+
+	if ((change = mowgli_patricia_retrieve(dump->delta, key)) != NULL)
+	{
+		change->added = added;
+		return;
+	}
+
+	fromlen = strlen(from) + 1;
+	tolen = strlen(to) + 1;
+
+	change = smalloc(sizeof *change + fromlen + tolen);
+	change->added = added;
+	change->to = change->from + fromlen;
+	memcpy(change->from, from, fromlen);
+	memcpy(change->to, to, tolen);
+
+	mowgli_patricia_add(dump->delta, key, change);
+}
+
+/*
+ * Writes every change since the last full dump, so that the full dump
+ * plus the latest delta file always describe the current graph. Deltas
+ * are bounded by GRAPH_DELTA_MAX and are written in one go.
+ */
+static void
+graph_dump_write_delta(graph_dump_t *dump, const graph_format_t *format)
+{
+	mowgli_patricia_iteration_state_t state;
+	graph_change_t *change;
+	int failure;
+
+	slog(LG_DEBUG, "graphtastical: writing %u changes to %s as %s", mowgli_patricia_size(dump->delta),
+			dump->name, format->name);
+
+	if ((failure = graph_dump_open(dump, format, ".delta")) != 0)
+	{
+		graph_dump_report(dump, failure, dump->error);
+		return;
+	}
+
+	MOWGLI_PATRICIA_FOREACH(change, &state, dump->delta)
+		format->change(dump, change->from, change->to, change->added);
+
+	if ((failure = graph_dump_close(dump)) != 0)
+	{
+		graph_dump_report(dump, failure, dump->error);
+		return;
+	}
+
+	dump->delta_dirty = false;
+}
+
+static void
+graph_dump_start(void *arg)
+{
+	graph_dump_t *dump = arg;
+	const graph_format_t *format;
+	int failure;
+
+	if (dump->enabled != NULL && !*dump->enabled)
+		return;
+
+	if (dump->running)
+	{
+		slog(LG_DEBUG, "graphtastical: %s dump still in progress, not restarting it", dump->name);
+		return;
+	}
+
+	if ((format = graph_format_find(graph_format_name)) == NULL)
+	{
+		slog(LG_ERROR, "graphtastical: unknown graphtastical_format '%s', using dot", graph_format_name);
+		format = &graph_formats[0];
+	}
+
+	/* computed graphs cannot be split into slices, so they are only
+	 * exported from a forked child
+	 */
+	if (dump->write_all != NULL && !graph_fork)
+	{
+		if (!dump->refused)
+			slog(LG_ERROR, "graphtastical: the %s graph needs graphtastical_fork, not writing it", dump->name);
+
+		dump->refused = true;
+		return;
+	}
+
+	dump->refused = false;
+
+	if (CURRTIME < dump->next_full && mowgli_patricia_size(dump->delta) <= GRAPH_DELTA_MAX)
+	{
+		if (dump->delta_dirty)
+			graph_dump_write_delta(dump, format);
+
+		return;
+	}
+
+	slog(LG_DEBUG, "graphtastical: dumping %s as %s", dump->name, format->name);
+
+	/* the new full dump covers everything seen so far */
+	graph_delta_clear(dump);
+	dump->next_full = CURRTIME + graph_full_interval;
+
+	if (graph_fork)
+	{
+		graph_dump_fork(dump, format);
+		return;
+	}
+
+	if ((failure = graph_dump_open(dump, format, "")) != 0)
+	{
+		graph_dump_report(dump, failure, dump->error);
+		return;
+	}
+
+	mowgli_patricia_foreach_start(*dump->tree, &dump->state);
+
+	dump->running = true;
+	graph_dump_step(dump);
+}
+
+/*
+ * An element is about to leave the tree a dump is walking. The saved
+ * iteration state holds both the element to resume at and the one after
+ * it, so step past the element before it goes away if it is either.
+ */
+static void
+graph_dump_forget(graph_dump_t *dump, void *data)
+{
+	mowgli_patricia_iteration_state_t peek;
+	void *cur;
+
+	if (!dump->running || dump->pid != 0)
+		return;
+
+	cur = mowgli_patricia_foreach_cur(*dump->tree, &dump->state);
+
+	if (cur == data)
+	{
+		mowgli_patricia_foreach_next(*dump->tree, &dump->state);
+		return;
+	}
+
+	peek = dump->state;
+	mowgli_patricia_foreach_next(*dump->tree, &peek);
+
+	if (mowgli_patricia_foreach_cur(*dump->tree, &peek) == data)
+	{
+		dump->write_node(dump, cur);
+		mowgli_patricia_foreach_next(*dump->tree, &dump->state);
+		mowgli_patricia_foreach_next(*dump->tree, &dump->state);
+	}
+}
+
+static bool
+graph_chanacs_is_edge(unsigned int level)
+{
+	return level != 0 && !(level & CA_AKICK);
+}
+
+static void
+graph_chanacs_record(mychan_t *mc, bool added)
+{
+	chanacs_t *ca;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, mc->chanacs.head)
+	{
+		ca = n->data;
+
+		if (graph_chanacs_is_edge(ca->level))
+			graph_delta_record(&channels_dump, ca->entity ? ca->entity->name : ca->host, mc->name, added);
+	}
+}
+
+static void
+graph_channel_register(hook_channel_req_t *hdata)
+{
+	graph_chanacs_record(hdata->mc, true);
+}
+
+static void
+graph_channel_drop(mychan_t *mc)
+{
+	graph_dump_forget(&channels_dump, mc);
+	graph_chanacs_record(mc, false);
+}
+
+static void
+graph_channel_acl_change(hook_channel_acl_req_t *hdata)
+{
+	chanacs_t *ca = hdata->ca;
+	bool was = graph_chanacs_is_edge(hdata->oldlevel);
+	bool now = graph_chanacs_is_edge(hdata->newlevel);
+
+	/* an earlier hook refused the change */
+	if (hdata->approved != 0)
+		return;
+
+	if (was != now)
+		graph_delta_record(&channels_dump, ca->entity ? ca->entity->name : ca->host, ca->mychan->name, now);
+}
+
+/* an account's access entries, as edges from the given name */
+static void
+graph_entity_record(myentity_t *mt, const char *name, bool added)
+{
+	chanacs_t *ca;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, mt->chanacs.head)
+	{
+		ca = n->data;
+
+		if (graph_chanacs_is_edge(ca->level))
+			graph_delta_record(&channels_dump, name, ca->mychan->name, added);
+	}
+}
+
+/* the account's access entries are removed without channel_acl_change */
+static void
+graph_user_drop(myuser_t *mu)
+{
+	graph_entity_record(entity(mu), entity(mu)->name, false);
+}
+
+static void
+graph_user_rename(hook_user_rename_t *data)
+{
+	graph_entity_record(entity(data->mu), data->oldname, false);
+	graph_entity_record(entity(data->mu), entity(data->mu)->name, true);
+}
+
+static void
+graph_channel_join(hook_channel_joinpart_t *hdata)
+{
+	chanuser_t *cu = hdata->cu;
+
+	/* another hook may have kicked them already */
+	if (cu == NULL)
+		return;
+
+	graph_delta_record(&uchannels_dump, cu->user->nick, cu->chan->name, true);
+}
+
+static void
+graph_channel_part(hook_channel_joinpart_t *hdata)
+{
+	chanuser_t *cu = hdata->cu;
+
+	if (cu == NULL)
+		return;
+
+	graph_delta_record(&uchannels_dump, cu->user->nick, cu->chan->name, false);
+}
+
+static void
+graph_user_nickchange(hook_user_nick_t *data)
+{
+	chanuser_t *cu;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, data->u->channels.head)
+	{
+		cu = n->data;
+
+		graph_delta_record(&uchannels_dump, data->oldnick, cu->chan->name, false);
+		graph_delta_record(&uchannels_dump, cu->user->nick, cu->chan->name, true);
+	}
+}
+
+static void
+graph_user_delete(user_t *u)
+{
+	chanuser_t *cu;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, u->channels.head)
+	{
+		cu = n->data;
+
+		graph_delta_record(&uchannels_dump, u->nick, cu->chan->name, false);
+	}
+}
+
+static void
+graph_channel_delete(channel_t *c)
+{
+	graph_dump_forget(&uchannels_dump, c);
+}
+
+static void
+mod_init(module_t *const restrict m)
+{
+	add_bool_conf_item("graphtastical_fork", &conf_gi_table, 0, &graph_fork, false);
+	add_dupstr_conf_item("graphtastical_format", &conf_gi_table, 0, &graph_format_name, "dot");
+	add_duration_conf_item("graphtastical_full_interval", &conf_gi_table, 0, &graph_full_interval, "m", 3600);
+	add_bool_conf_item("graphtastical_overlap", &conf_gi_table, 0, &graph_overlap, false);
+	add_uint_conf_item("graphtastical_overlap_min_shared", &conf_gi_table, 0, &graph_overlap_min_shared, 1, INT_MAX, 2);
+	add_uint_conf_item("graphtastical_overlap_top", &conf_gi_table, 0, &graph_overlap_top, 0, INT_MAX, 10);
+
+	channels_dump.delta = mowgli_patricia_create(NULL);
+	uchannels_dump.delta = mowgli_patricia_create(NULL);
+	overlap_dump.delta = mowgli_patricia_create(NULL);
+
+	hook_add_event("channel_register");
+	hook_add_channel_register(graph_channel_register);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(graph_channel_drop);
+
+	hook_add_event("channel_acl_change");
+	hook_add_channel_acl_change(graph_channel_acl_change);
+
+	hook_add_event("user_drop");
+	hook_add_user_drop(graph_user_drop);
+
+	hook_add_event("user_rename");
+	hook_add_user_rename(graph_user_rename);
+
+	hook_add_event("channel_delete");
+	hook_add_channel_delete(graph_channel_delete);
+
+	hook_add_event("channel_join");
+	hook_add_channel_join(graph_channel_join);
+
+	hook_add_event("channel_part");
+	hook_add_channel_part(graph_channel_part);
+
+	hook_add_event("user_nickchange");
+	hook_add_user_nickchange(graph_user_nickchange);
+
+	hook_add_event("user_delete");
+	hook_add_user_delete(graph_user_delete);
+
+	graph_dump_start(&channels_dump);
+	graph_dump_start(&uchannels_dump);
+	graph_dump_start(&overlap_dump);
+
+	channels_dump.timer = mowgli_timer_add(base_eventloop, "write_channels_dot_file", graph_dump_start, &channels_dump, 60);
+	uchannels_dump.timer = mowgli_timer_add(base_eventloop, "write_uchannels_dot_file", graph_dump_start, &uchannels_dump, 60);
+	overlap_dump.timer = mowgli_timer_add(base_eventloop, "write_overlap_file", graph_dump_start, &overlap_dump, 60);
+}
+
+static void
+mod_deinit(const module_unload_intent_t intent)
+{
+	del_conf_item("graphtastical_fork", &conf_gi_table);
+	del_conf_item("graphtastical_format", &conf_gi_table);
+	del_conf_item("graphtastical_full_interval", &conf_gi_table);
+	del_conf_item("graphtastical_overlap", &conf_gi_table);
+	del_conf_item("graphtastical_overlap_min_shared", &conf_gi_table);
+	del_conf_item("graphtastical_overlap_top", &conf_gi_table);
+
+	hook_del_channel_register(graph_channel_register);
+	hook_del_channel_drop(graph_channel_drop);
+	hook_del_channel_acl_change(graph_channel_acl_change);
+	hook_del_user_drop(graph_user_drop);
+	hook_del_user_rename(graph_user_rename);
+	hook_del_channel_delete(graph_channel_delete);
+	hook_del_channel_join(graph_channel_join);
+	hook_del_channel_part(graph_channel_part);
+	hook_del_user_nickchange(graph_user_nickchange);
+	hook_del_user_delete(graph_user_delete);
+	childproc_delete_all(graph_dump_reaped);
+
+	graph_dump_abort(&channels_dump);
+	graph_dump_abort(&uchannels_dump);
+	graph_dump_abort(&overlap_dump);
+
+	mowgli_timer_destroy(base_eventloop, channels_dump.timer);
+	mowgli_timer_destroy(base_eventloop, uchannels_dump.timer);
+	mowgli_timer_destroy(base_eventloop, overlap_dump.timer);
+
+	mowgli_patricia_destroy(channels_dump.delta, graph_change_free, NULL);
+	mowgli_patricia_destroy(uchannels_dump.delta, graph_change_free, NULL);
+	mowgli_patricia_destroy(overlap_dump.delta, graph_change_free, NULL);
+
+	sfree(channels_dump.buf);
+	sfree(uchannels_dump.buf);
+	sfree(overlap_dump.buf);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/graphtastical", MODULE_UNLOAD_CAPABILITY_NEVER)
@@ -12,19 +12,259 @@
 #  include "uplink.h"
 #endif
 
+/* keep RAM consumption per account from going out of control */
+#define AJOIN_MAX_ENTRIES	50
+
+typedef struct {
+	mowgli_node_t node;
+	char *chan;
+	char *key;
+} ajoin_entry_t;
+
+/*
+ * An account's channels in the order they were added, indexed by name for
+ * membership checks. Every list is also on ajoin_lists so the database
+ * writer does not have to visit accounts without one.
+ */
+typedef struct {
+	mowgli_node_t node;
+	myuser_t *mu;
+	mowgli_list_t entries;
+	mowgli_patricia_t *index;
+} ajoin_list_t;
+
+static mowgli_list_t ajoin_lists = { NULL, NULL, 0 };
+
+/* channels per SVSJOIN line, where the protocol takes more than one */
+#define AJOIN_LINE_CHANNELS	10
+
+typedef enum {
+	AJOIN_JOIN = 0,
+	AJOIN_SKIP_JOINED,
+	AJOIN_SKIP_CLOSED,
+	AJOIN_SKIP_REFUSED,
+	AJOIN_STAT_COUNT
+} ajoin_skip_t;
+
+/* channels joined and skipped since load, shown in OperServ INFO */
+static unsigned long long ajoin_stats[AJOIN_STAT_COUNT];
+
+/* a user whose joins are waiting for the rate limit, and how far it got */
+typedef struct {
+	mowgli_node_t node;
+	user_t *u;
+	unsigned int done;
+} ajoin_pending_t;
+
+/*
+ * SVSJOIN lines are paced network-wide by a token bucket holding up to
+ * ajoin_burst lines and refilled with ajoin_rate lines per second; users
+ * that find it empty wait in ajoin_queue, drained once a second.
+ */
+static mowgli_list_t ajoin_queue = { NULL, NULL, 0 };
+static mowgli_eventloop_timer_t *ajoin_timer = NULL;
+static unsigned int ajoin_rate = 50;
+static unsigned int ajoin_burst = 200;
+static unsigned int ajoin_tokens = 200;
+static time_t ajoin_refilled = 0;
+
+static ajoin_entry_t *
+ajoin_add_entry(ajoin_list_t *al, const char *chan, const char *key)
+{
+	ajoin_entry_t *ae;
+
+	if (mowgli_patricia_retrieve(al->index, chan) != NULL)
+		return NULL;
+
+	ae = smalloc(sizeof *ae);
+	ae->chan = sstrdup(chan);
+	ae->key = key != NULL ? sstrdup(key) : NULL;
+
+	mowgli_node_add(ae, &ae->node, &al->entries);
+	mowgli_patricia_add(al->index, ae->chan, ae);
+
+	return ae;
+}
+
+static void
+ajoin_del_entry(ajoin_list_t *al, ajoin_entry_t *ae)
+{
+	mowgli_patricia_delete(al->index, ae->chan);
+	mowgli_node_delete(&ae->node, &al->entries);
+
+	sfree(ae->chan);
+	sfree(ae->key);
+	sfree(ae);
+}
+
+static void
+ajoin_list_free(ajoin_list_t *al)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, al->entries.head)
+		ajoin_del_entry(al, n->data);
+
+	mowgli_patricia_destroy(al->index, NULL, NULL);
+	mowgli_node_delete(&al->node, &ajoin_lists);
+	privatedata_delete(al->mu, "ajoin:list");
+	sfree(al);
+}
+
+/*
+ * Returns the account's list, creating it if asked to. Lists that still
+ * live in the old comma-separated private:autojoin metadata are moved
+ * over the first time they are needed.
+ */
+static ajoin_list_t *
+ajoin_list_get(myuser_t *mu, bool create)
+{
+	ajoin_list_t *al = privatedata_get(mu, "ajoin:list");
+	metadata_t *md;
+	char *buf, *chan, *key, *save;
+
+	if (al != NULL)
+		return al;
+
+	md = metadata_find(mu, "private:autojoin");
+
+	if (md == NULL && !create)
+		return NULL;
+
+	al = smalloc(sizeof *al);
+	al->mu = mu;
+	al->entries = (mowgli_list_t) { NULL, NULL, 0 };
+	al->index = mowgli_patricia_create(irccasecanon);
+	mowgli_node_add(al, &al->node, &ajoin_lists);
+	privatedata_set(mu, "ajoin:list", al);
+
+	if (md != NULL)
+	{
+		buf = sstrdup(md->value);
+
+		for (chan = strtok_r(buf, ",", &save); chan != NULL; chan = strtok_r(NULL, ",", &save))
+		{
+			if ((key = strchr(chan, ' ')) != NULL)
+				*key++ = '\0';
+
+			if (*chan != '\0' && MOWGLI_LIST_LENGTH(&al->entries) < AJOIN_MAX_ENTRIES)
+				ajoin_add_entry(al, chan, key != NULL && *key != '\0' ? key : NULL);
+		}
+
+		sfree(buf);
+		metadata_delete(mu, "private:autojoin");
+	}
+
+	return al;
+}
+
+/*
+ * Puts the list back into private:autojoin as "#chan[ key],..." and frees
+ * it, so that unloading or reloading the module does not lose it; the
+ * next instance picks it up again through ajoin_list_get().
+ */
+static void
+ajoin_list_store(ajoin_list_t *al)
+{
+	mowgli_node_t *n;
+	ajoin_entry_t *ae;
+	size_t len = 1;
+	char *buf;
+
+	MOWGLI_ITER_FOREACH(n, al->entries.head)
+	{
+		ae = n->data;
+		len += strlen(ae->chan) + 1 + (ae->key != NULL ? strlen(ae->key) + 1 : 0);
+	}
+
+	buf = smalloc(len);
+	*buf = '\0';
+
+	MOWGLI_ITER_FOREACH(n, al->entries.head)
+	{
+		ae = n->data;
+
+		if (*buf != '\0')
+			mowgli_strlcat(buf, ",", len);
+
+		mowgli_strlcat(buf, ae->chan, len);
+
+		if (ae->key != NULL)
+		{
+			mowgli_strlcat(buf, " ", len);
+			mowgli_strlcat(buf, ae->key, len);
+		}
+	}
+
+	if (*buf != '\0')
+		metadata_add(al->mu, "private:autojoin", buf);
+
+	sfree(buf);
+	ajoin_list_free(al);
+}
+
+static void
+write_ajoindb(database_handle_t *db)
+{
+	mowgli_node_t *n, *n2;
+
+	MOWGLI_ITER_FOREACH(n, ajoin_lists.head)
+	{
+		ajoin_list_t *al = n->data;
+
+		MOWGLI_ITER_FOREACH(n2, al->entries.head)
+		{
+			ajoin_entry_t *ae = n2->data;
+
+			db_start_row(db, "AJ");
+			db_write_word(db, entity(al->mu)->name);
+			db_write_word(db, ae->chan);
+			if (ae->key != NULL)
+				db_write_word(db, ae->key);
+			db_commit_row(db);
+		}
+	}
+}
+
+static void
+db_h_aj(database_handle_t *db, const char *type)
+{
+	const char *name = db_sread_word(db);
+	const char *chan = db_sread_word(db);
+	const char *key = db_read_word(db);
+	myuser_t *mu;
+
+	if ((mu = myuser_find(name)) == NULL)
+	{
+		slog(LG_INFO, "db-h-aj: AJOIN entry for nonexistent account %s", name);
+		return;
+	}
+
+	ajoin_add_entry(ajoin_list_get(mu, true), chan, key);
+}
+
+static void
+ajoin_on_drop(myuser_t *mu)
+{
+	ajoin_list_t *al = privatedata_get(mu, "ajoin:list");
+
+	if (al != NULL)
+		ajoin_list_free(al);
+}
+
 static void
 ns_cmd_ajoin_syntaxerr(sourceinfo_t *si)
 {
 	command_fail(si, fault_badparams, STR_INSUFFICIENT_PARAMS, "AJOIN");
-	command_fail(si, fault_badparams, _("Syntax: AJOIN <LIST|ADD|DEL|CLEAR> [#channel]"));
+	command_fail(si, fault_badparams, _("Syntax: AJOIN <LIST|ADD|DEL|CLEAR> [#channel] [key]"));
 }
 
 static void
 ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 {
-	char buf[512];
-	char *chan;
-	metadata_t *md;
+	ajoin_list_t *al;
+	ajoin_entry_t *ae;
+	mowgli_node_t *n;
 
 	if (!parv[0])
 		return ns_cmd_ajoin_syntaxerr(si);
@@ -33,15 +273,16 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 	{
 		command_success_nodata(si, "\2AJOIN LIST\2:");
 
-		if ((md = metadata_find(si->smu, "private:autojoin")))
+		if ((al = ajoin_list_get(si->smu, false)) != NULL)
 		{
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			chan = strtok(buf, ",");
-
-			while (chan != NULL)
+			MOWGLI_ITER_FOREACH(n, al->entries.head)
 			{
-				command_success_nodata(si, "%s", chan);
-				chan = strtok(NULL, ",");
+				ae = n->data;
+
+				if (ae->key != NULL)
+					command_success_nodata(si, "%s (key: %s)", ae->chan, ae->key);
+				else
+					command_success_nodata(si, "%s", ae->chan);
 			}
 		}
 
@@ -52,45 +293,36 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 		if (!parv[1])
 			return ns_cmd_ajoin_syntaxerr(si);
 
-		if ((md = metadata_find(si->smu, "private:autojoin")))
+		/* the list ends up in SVSJOIN parameters */
+		if (strpbrk(parv[1], ", ") != NULL || (parv[2] && strpbrk(parv[2], ", ") != NULL))
 		{
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			chan = strtok(buf, ",");
-
-			while (chan != NULL)
-			{
-				if (!strcasecmp(chan, parv[1]))
-				{
-					command_fail(si, fault_badparams, _("%s is already on your AJOIN list."), parv[1]);
-					return;
-				}
-
-				chan = strtok(NULL, ",");
-			}
+			command_fail(si, fault_badparams, _("%s is not a valid channel name."), parv[1]);
+			return;
+		}
 
-			// Little arbitrary, but stop both overflow and RAM consumption going out of control
-			if (strlen(md->value) + strlen(parv[1]) > 400)
-			{
-				command_fail(si, fault_badparams, _("Sorry, you have too many AJOIN entries set."));
-				return;
-			}
+		al = ajoin_list_get(si->smu, true);
 
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			mowgli_strlcat(buf, ",", sizeof buf);
-			mowgli_strlcat(buf, parv[1], sizeof buf);
-			metadata_delete(si->smu, "private:autojoin");
-			metadata_add(si->smu, "private:autojoin", buf);
+		if (mowgli_patricia_retrieve(al->index, parv[1]) != NULL)
+		{
+			command_fail(si, fault_badparams, _("%s is already on your AJOIN list."), parv[1]);
+			return;
 		}
-		else
+
+		if (MOWGLI_LIST_LENGTH(&al->entries) >= AJOIN_MAX_ENTRIES)
 		{
-			metadata_add(si->smu, "private:autojoin", parv[1]);
+			command_fail(si, fault_badparams, _("Sorry, you have too many AJOIN entries set."));
+			return;
 		}
 
+		ajoin_add_entry(al, parv[1], parv[2]);
+
 		command_success_nodata(si, _("%s added to AJOIN successfully."), parv[1]);
 	}
 	else if (!strcasecmp(parv[0], "CLEAR"))
 	{
-		metadata_delete(si->smu, "private:autojoin");
+		if ((al = ajoin_list_get(si->smu, false)) != NULL)
+			ajoin_list_free(al);
+
 		command_success_nodata(si, _("AJOIN list cleared successfully."));
 	}
 	else if (!strcasecmp(parv[0], "DEL"))
@@ -98,117 +330,279 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 		if (!parv[1])
 			return ns_cmd_ajoin_syntaxerr(si);
 
-		if (!(md = metadata_find(si->smu, "private:autojoin")))
+		if ((al = ajoin_list_get(si->smu, false)) == NULL ||
+				(ae = mowgli_patricia_retrieve(al->index, parv[1])) == NULL)
 		{
 			command_fail(si, fault_badparams, _("%s is not on your AJOIN list."), parv[1]);
 			return;
 		}
 
-		// Thanks to John Brooks for his help with this.
-		char *list = md->value;
-		char *remove1 = parv[1];
+		ajoin_del_entry(al, ae);
 
-		int listlen = 0;
-		int rmlen = 0;
-		int itempos = 0;
-		int i = 0, j = 0;
+		if (MOWGLI_LIST_LENGTH(&al->entries) == 0)
+			ajoin_list_free(al);
+
+		command_success_nodata(si, _("%s removed from AJOIN successfully."), parv[1]);
+	}
+}
+
+/* UnrealIRCd takes comma-separated channel and key lists in SVSJOIN like in JOIN */
+static bool
+ajoin_multi_target(void)
+{
+	return ircd->type == PROTOCOL_UNREAL;
+}
 
-		// This loop will find the item (if present), find the length of the item,
-		// and find the length of the entire string.
-		for (; list[i]; i++)
+static void
+ajoin_send(user_t *u, const char *chans, const char *keys)
+{
+	if(ircd->type == PROTOCOL_ELEMENTAL_IRCD)
+	{
+		sts(":%s ENCAP * SVSJOIN %s %s%s%s", ME, CLIENT_NAME(u), chans,
+				*keys ? " " : "", keys);
+	}
+	else
+	{
+		sts(":%s SVSJOIN %s %s%s%s", CLIENT_NAME(nicksvs.me->me), CLIENT_NAME(u), chans,
+				*keys ? " " : "", keys);
+	}
+}
+
+/*
+ * Whether an SVSJOIN to this entry would be wasted: the user is already
+ * there, or the join is going to be refused or get the user klined.
+ */
+static ajoin_skip_t
+ajoin_check(user_t *u, ajoin_entry_t *ae)
+{
+	channel_t *c = channel_find(ae->chan);
+	mychan_t *mc = c != NULL ? mychan_from(c) : mychan_find(ae->chan);
+
+	if (mc != NULL && (metadata_find(mc, "private:close:closer") || metadata_find(mc, "private:klinechan:closer")))
+		return AJOIN_SKIP_CLOSED;
+
+	if (c == NULL)
+		return AJOIN_JOIN;
+
+	if (chanuser_find(c, u) != NULL)
+		return AJOIN_SKIP_JOINED;
+
+	if (c->key != NULL && (ae->key == NULL || strcmp(c->key, ae->key)))
+		return AJOIN_SKIP_REFUSED;
+
+	if ((c->modes & CMODE_INVITE) && (!ircd->invex_mchar || next_matching_ban(c, u, ircd->invex_mchar, c->bans.head) == NULL))
+		return AJOIN_SKIP_REFUSED;
+
+	if (next_matching_ban(c, u, 'b', c->bans.head) != NULL &&
+			(!ircd->except_mchar || next_matching_ban(c, u, ircd->except_mchar, c->bans.head) == NULL))
+		return AJOIN_SKIP_REFUSED;
+
+	return AJOIN_JOIN;
+}
+
+/*
+ * Builds one SVSJOIN line from the entries starting at *pos and moves *pos
+ * past them, leaving out those ajoin_check() rejects; returns how many it
+ * moved past. Keys are matched to channels by position, so a keyed entry
+ * can only be added while every entry before it in the line has a key.
+ */
+static unsigned int
+ajoin_next_line(user_t *u, mowgli_node_t **pos, char *chans, size_t chanlen, char *keys, size_t keylen)
+{
+	ajoin_entry_t *ae;
+	ajoin_skip_t result;
+	unsigned int count = 0, consumed = 0;
+	bool keyless = false;
+
+	*chans = *keys = '\0';
+
+	while (*pos != NULL)
+	{
+		ae = (*pos)->data;
+
+		if ((result = ajoin_check(u, ae)) != AJOIN_JOIN)
 		{
-			if (!rmlen)
-			{
-				// We have not found the string yet
-				if (tolower(list[i]) == tolower(remove1[j]))
-				{
-					if (j == 0)
-					{
-						// First character of a potential match; remember it's location
-						itempos = i;
-					}
-
-					j++;
-
-					if (!remove1[j])
-					{
-						// Found the entire string
-						rmlen = j;
-					}
-				}
-				else
-					j = 0;
-			}
+			ajoin_stats[result]++;
+			consumed++;
+			*pos = (*pos)->next;
+			continue;
 		}
 
-		if (remove1[j])
+		if (count != 0)
 		{
-			command_fail(si, fault_badparams, _("%s is not on your AJOIN list."), parv[1]);
-			return;
+			if (!ajoin_multi_target() || count >= AJOIN_LINE_CHANNELS)
+				break;
+
+			if (ae->key != NULL && keyless)
+				break;
+
+			if (strlen(chans) + strlen(ae->chan) + 2 > chanlen ||
+					(ae->key != NULL && strlen(keys) + strlen(ae->key) + 2 > keylen))
+				break;
+
+			mowgli_strlcat(chans, ",", chanlen);
 		}
 
-		listlen = i;
+		mowgli_strlcat(chans, ae->chan, chanlen);
 
-		// listlen is the length of the list, rmlen is the length of the item to remove,
-		// itempos is the beginning of that item.
-		if (!list[itempos + rmlen])
+		if (ae->key != NULL)
 		{
-			// This item is the last item in the list, so we can simply truncate
-			if (itempos > 0)
-			{
-				itempos--;
-				list[itempos] = '\0';
-			}
-			else
-				metadata_delete(si->smu, "private:autojoin");
+			if (*keys)
+				mowgli_strlcat(keys, ",", keylen);
+			mowgli_strlcat(keys, ae->key, keylen);
 		}
 		else
-		{
-			// There are items after this one, so we must copy memory
-			// Account for the comma following this item (if there is a space,
-			// account for that too, depends on how you format your list)
-			rmlen += 1;
-			memmove(list + itempos, list + itempos + rmlen, listlen - rmlen - itempos);
-			list[listlen - rmlen] = '\0';
-		}
+			keyless = true;
 
-		command_success_nodata(si, _("%s removed from AJOIN successfully."), parv[1]);
+		ajoin_stats[AJOIN_JOIN]++;
+		count++;
+		consumed++;
+		*pos = (*pos)->next;
 	}
+
+	return consumed;
+}
+
+static void
+ajoin_refill(void)
+{
+	time_t elapsed = CURRTIME - ajoin_refilled;
+
+	if (elapsed > 0)
+	{
+		if ((unsigned long long) elapsed * ajoin_rate >= ajoin_burst)
+			ajoin_tokens = ajoin_burst;
+		else
+			ajoin_tokens += (unsigned int) elapsed * ajoin_rate;
+
+		ajoin_refilled = CURRTIME;
+	}
+
+	if (ajoin_tokens > ajoin_burst)
+		ajoin_tokens = ajoin_burst;
+}
+
+/* sends as much of the user's list as the bucket allows; true once all of it is out */
+static bool
+ajoin_run(ajoin_pending_t *p)
+{
+	char chans[BUFSIZE / 2], keys[BUFSIZE / 4];
+	ajoin_list_t *al;
+	mowgli_node_t *pos;
+	unsigned int i;
+
+	if (p->u->myuser == NULL || (al = ajoin_list_get(p->u->myuser, false)) == NULL)
+		return true;
+
+	for (pos = al->entries.head, i = 0; pos != NULL && i < p->done; pos = pos->next, i++)
+		;
+
+	while (pos != NULL)
+	{
+		if (ajoin_tokens == 0)
+			return false;
+
+		p->done += ajoin_next_line(p->u, &pos, chans, sizeof chans, keys, sizeof keys);
+
+		/* everything that was left got skipped */
+		if (*chans == '\0')
+			break;
+
+		ajoin_send(p->u, chans, keys);
+		ajoin_tokens--;
+	}
+
+	return true;
+}
+
+static void
+ajoin_pending_free(ajoin_pending_t *p)
+{
+	mowgli_node_delete(&p->node, &ajoin_queue);
+	privatedata_delete(p->u, "ajoin:pending");
+	sfree(p);
+}
+
+static void
+ajoin_drain(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	ajoin_timer = NULL;
+
+	ajoin_refill();
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ajoin_queue.head)
+	{
+		if (!ajoin_run(n->data))
+			break;
+
+		ajoin_pending_free(n->data);
+	}
+
+	/* the timer only exists while someone is waiting */
+	if (MOWGLI_LIST_LENGTH(&ajoin_queue) != 0)
+		ajoin_timer = mowgli_timer_add_once(base_eventloop, "ajoin_drain", ajoin_drain, NULL, 1);
 }
 
 static void
 ajoin_on_identify(user_t *u)
 {
-	myuser_t *mu = u->myuser;
-	metadata_t *md;
-	char buf[512];
-	char *chan;
+	ajoin_pending_t *p;
 
-	if (!(md = metadata_find(mu, "private:autojoin")))
+	if (ajoin_list_get(u->myuser, false) == NULL)
 		return;
 
-	mowgli_strlcpy(buf, md->value, sizeof buf);
-	chan = strtok(buf, " ,");
-	while (chan != NULL)
+	/* identifying again while queued starts the list over, in the same place in the queue */
+	if ((p = privatedata_get(u, "ajoin:pending")) != NULL)
 	{
-		if(ircd->type == PROTOCOL_ELEMENTAL_IRCD)
-		{
-			sts(":%s ENCAP * SVSJOIN %s %s", ME, CLIENT_NAME(u), chan);
-		}
-		else
-		{
-			sts(":%s SVSJOIN %s %s", CLIENT_NAME(nicksvs.me->me), CLIENT_NAME(u), chan);
-		}
+		p->done = 0;
+		return;
+	}
 
-		chan = strtok(NULL, ",");
+	p = smalloc(sizeof *p);
+	p->u = u;
+	p->done = 0;
+
+	ajoin_refill();
+
+	if (MOWGLI_LIST_LENGTH(&ajoin_queue) == 0 && ajoin_run(p))
+	{
+		sfree(p);
+		return;
 	}
+
+	mowgli_node_add(p, &p->node, &ajoin_queue);
+	privatedata_set(u, "ajoin:pending", p);
+
+	if (ajoin_timer == NULL)
+		ajoin_timer = mowgli_timer_add_once(base_eventloop, "ajoin_drain", ajoin_drain, NULL, 1);
+}
+
+static void
+ajoin_info_hook(sourceinfo_t *si)
+{
+	return_if_fail(si != NULL);
+
+	command_success_nodata(si, "AJOIN channels joined: %llu, skipped: %llu already joined, %llu closed, %llu banned/invite-only/keyed",
+			ajoin_stats[AJOIN_JOIN], ajoin_stats[AJOIN_SKIP_JOINED],
+			ajoin_stats[AJOIN_SKIP_CLOSED], ajoin_stats[AJOIN_SKIP_REFUSED]);
+}
+
+static void
+ajoin_on_user_delete(user_t *u)
+{
+	ajoin_pending_t *p = privatedata_get(u, "ajoin:pending");
+
+	if (p != NULL)
+		ajoin_pending_free(p);
 }
 
 static command_t ns_ajoin = {
 	.name           = "AJOIN",
 	.desc           = N_("Manages automatic-join on identify."),
 	.access         = AC_AUTHENTICATED,
-	.maxparc        = 2,
+	.maxparc        = 3,
 	.cmd            = &ns_cmd_ajoin,
 	.help           = { .path = "contrib/ajoin" },
 };
@@ -216,8 +610,27 @@ static command_t ns_ajoin = {
 static void
 mod_init(module_t *const restrict m)
 {
+	if (!module_find_published("backend/opensex"))
+	{
+		slog(LG_INFO, "Module %s requires use of the OpenSEX database backend, refusing to load.", m->name);
+		m->mflags |= MODFLAG_FAIL;
+		return;
+	}
+
 	hook_add_event("user_identify");
 	hook_add_user_identify(ajoin_on_identify);
+	hook_add_event("user_drop");
+	hook_add_user_drop(ajoin_on_drop);
+	hook_add_event("user_delete");
+	hook_add_user_delete(ajoin_on_user_delete);
+	hook_add_event("operserv_info");
+	hook_add_operserv_info(ajoin_info_hook);
+	hook_add_db_write(write_ajoindb);
+
+	db_register_type_handler("AJ", db_h_aj);
+
+	add_uint_conf_item("ajoin_rate", &conf_gi_table, 0, &ajoin_rate, 1, INT_MAX, 50);
+	add_uint_conf_item("ajoin_burst", &conf_gi_table, 0, &ajoin_burst, 1, INT_MAX, 200);
 
 	service_named_bind_command("nickserv", &ns_ajoin);
 }
@@ -225,7 +638,27 @@ mod_init(module_t *const restrict m)
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	hook_del_user_identify(ajoin_on_identify);
+	hook_del_user_drop(ajoin_on_drop);
+	hook_del_user_delete(ajoin_on_user_delete);
+	hook_del_operserv_info(ajoin_info_hook);
+	hook_del_db_write(write_ajoindb);
+
+	db_unregister_type_handler("AJ");
+
+	del_conf_item("ajoin_rate", &conf_gi_table);
+	del_conf_item("ajoin_burst", &conf_gi_table);
+
+	if (ajoin_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, ajoin_timer);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ajoin_queue.head)
+		ajoin_pending_free(n->data);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ajoin_lists.head)
+		ajoin_list_store(n->data);
 
 	service_named_unbind_command("nickserv", &ns_ajoin);
 }
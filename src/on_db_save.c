@@ -7,21 +7,234 @@
 
 #ifndef _WIN32
 
-static struct update_command_state {
-	connection_t *out, *err;
+#include <inttypes.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+
+extern char **environ;
+
+/*
+ * The replication stream sent to the receiver on its stdin, as understood
+ * by atheme-dbrecv (tools/dbrecv.c):
+ *
+ *   ATHEME-DBSYNC 1 <base digest> <length> <digest>
+ *   C <hash> <length>        a chunk of the previous copy, by hash
+ *   L <length>               followed by that many bytes of new data
+ *   E                        end of stream
+ *
+ * Digests and hashes are 64-bit FNV-1a in hex; a base digest of 0 means
+ * the stream does not depend on the previous copy. Chunks end after a
+ * line whose hash has its low five bits clear, or once they exceed
+ * REPLICA_CHUNK_MAX, so an edit only changes the chunks around it. The
+ * receiver splits its copy the same way to find the chunks by hash.
+ */
+#define REPLICA_FNV_OFFSET	UINT64_C(14695981039346656037)
+#define REPLICA_FNV_PRIME	UINT64_C(1099511628211)
+#define REPLICA_CHUNK_MASK	0x1f
+#define REPLICA_CHUNK_MAX	(64 * 1024)
+
+/* finished commands remembered for DBUPDATE, and how long a killed one gets before SIGKILL */
+#define UPDATE_HISTORY_SIZE	32U
+#define UPDATE_KILL_GRACE	10
+
+/* one command of a run, with its placeholders already filled in */
+typedef struct {
+	mowgli_node_t node;
+	char **argv;
 	pid_t pid;
+	connection_t *out, *err;
+
+	/* what goes into the history once it exits */
+	unsigned long long started_ms;
+	size_t output;
+	bool timed_out;
+	mowgli_eventloop_timer_t *kill_timer;
+
+	/* replication: the stream still to be written, and what it will leave behind */
+	bool replicate;
+	connection_t *in;
+	char *stream;
+	size_t stream_len, stream_size, stream_off;
+	mowgli_patricia_t *chunks;
+	uint64_t digest;
+} update_job_t;
+
+/* a run starts every configured command once, at most max_parallel at a time */
+static struct update_command_state {
+	mowgli_list_t jobs;
+	mowgli_node_t *next;
+	unsigned int active;
 	int running;
+	unsigned long long saved_ms;
 } update_command_proc;
 
+/* one finished command; launch latency is measured from the save that caused it */
+struct update_record {
+	char name[64];
+	time_t started;
+	unsigned long long launch_ms, run_ms;
+	int status;
+	bool timed_out;
+	size_t output;
+};
+
+static struct update_record update_history[UPDATE_HISTORY_SIZE];
+static unsigned int update_history_next = 0;
+static unsigned int update_history_count = 0;
+
 static char *command = NULL;
 
+/* argv lists from the db_update_commands block */
+static mowgli_list_t commands = { NULL, NULL, 0 };
+static unsigned int max_parallel = 1;
+static char *database_path = NULL;
+
+/* the receiver, and the chunks of the copy it was last sent successfully */
+static char **replicate_argv = NULL;
+static mowgli_patricia_t *replica_chunks = NULL;
+static uint64_t replica_digest = 0;
+
+/* saves that arrive too early are folded into one later run */
+static unsigned int min_interval = 0;
+static time_t last_run = 0;
+static time_t last_save = 0;
+static unsigned long long last_save_ms = 0;
+static bool run_pending = false;
+static mowgli_eventloop_timer_t *delay_timer = NULL;
+
+/* commands still running after this long are killed; 0 lets them run forever */
+static unsigned int update_timeout = 0;
+
+static void schedule_update_command(void);
+static void start_update_jobs(void);
+
+static unsigned long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long) ts.tv_sec * 1000ULL + (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
+static void
+free_argv(char **argv)
+{
+	char **arg;
+
+	for (arg = argv; *arg != NULL; arg++)
+		sfree(*arg);
+
+	sfree(argv);
+}
+
+static void
+free_update_job(update_job_t *job)
+{
+	if (job->in != NULL)
+	{
+		job->in->userdata = NULL;
+		connection_close_soon(job->in);
+	}
+
+	/* the output pipes may still be drained after the job is gone */
+	if (job->out != NULL)
+		job->out->userdata = NULL;
+
+	if (job->err != NULL)
+		job->err->userdata = NULL;
+
+	if (job->kill_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, job->kill_timer);
+
+	if (job->chunks != NULL)
+		mowgli_patricia_destroy(job->chunks, NULL, NULL);
+
+	mowgli_node_delete(&job->node, &update_command_proc.jobs);
+	free_argv(job->argv);
+	sfree(job->stream);
+	sfree(job);
+}
+
+static void
+record_update_job(update_job_t *job, int status)
+{
+	struct update_record *rec = &update_history[update_history_next];
+	unsigned long long now = now_ms();
+
+	/* the shell wrapper would make every legacy command look alike */
+	mowgli_strlcpy(rec->name, job->argv[1] != NULL && !strcmp(job->argv[1], "-c") && job->argv[2] != NULL ?
+			job->argv[2] : job->argv[0], sizeof rec->name);
+	rec->started = CURRTIME - (time_t) ((now - job->started_ms) / 1000ULL);
+	rec->launch_ms = job->started_ms - update_command_proc.saved_ms;
+	rec->run_ms = now - job->started_ms;
+	rec->status = status;
+	rec->timed_out = job->timed_out;
+	rec->output = job->output;
+
+	update_history_next = (update_history_next + 1) % UPDATE_HISTORY_SIZE;
+	if (update_history_count < UPDATE_HISTORY_SIZE)
+		update_history_count++;
+}
+
+static void
+update_command_kill(void *arg)
+{
+	update_job_t *job = arg;
+
+	/* a command that ignored SIGTERM gets SIGKILL once the grace period is over */
+	if (job->timed_out)
+	{
+		job->kill_timer = NULL;
+		kill(job->pid, SIGKILL);
+		return;
+	}
+
+	slog(LG_INFO, "on_db_save: database update command %s (pid %d) timed out, terminating it", job->argv[0], (int) job->pid);
+
+	job->timed_out = true;
+	job->kill_timer = mowgli_timer_add_once(base_eventloop, "update_command_kill", update_command_kill, job, UPDATE_KILL_GRACE);
+	kill(job->pid, SIGTERM);
+}
+
 static void
 update_command_finished(pid_t pid, int status, void *data)
 {
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		slog(LG_ERROR, "ERROR: Database update command failed with error %d", WEXITSTATUS(status));
+	update_job_t *job = data;
+	bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
 
-	update_command_proc.running = 0;
+	if (job->timed_out)
+		slog(LG_ERROR, "ERROR: Database update command %s was killed after running for more than %u seconds", job->argv[0], update_timeout);
+	else if (WIFSIGNALED(status))
+		slog(LG_ERROR, "ERROR: Database update command %s was killed by signal %d", job->argv[0], WTERMSIG(status));
+	else if (!ok)
+		slog(LG_ERROR, "ERROR: Database update command %s failed with error %d", job->argv[0], WEXITSTATUS(status));
+
+	record_update_job(job, status);
+
+	/* unless the receiver applied it, the next stream must not depend on this one */
+	if (job->replicate)
+	{
+		if (replica_chunks != NULL)
+			mowgli_patricia_destroy(replica_chunks, NULL, NULL);
+
+		replica_chunks = NULL;
+		replica_digest = 0;
+
+		if (ok && job->stream_off == job->stream_len)
+		{
+			replica_chunks = job->chunks;
+			replica_digest = job->digest;
+			job->chunks = NULL;
+		}
+	}
+
+	free_update_job(job);
+
+	update_command_proc.active--;
+	start_update_jobs();
 }
 
 static void
@@ -33,6 +246,10 @@ update_command_recvq_handler(connection_t *cptr, int err)
 	count = recvq_getline(cptr, buf, sizeof(buf) - 1);
 	if (count <= 0)
 		return;
+	/* the connection can outlive its job, whose output is then no longer counted */
+	if (cptr->userdata != NULL)
+		((update_job_t *) cptr->userdata)->output += count;
+
 	if (buf[count-1] == '\n')
 		count--;
 	if (count == 0)
@@ -47,6 +264,20 @@ update_command_recvq_handler(connection_t *cptr, int err)
 		slog(LG_DEBUG, "db update command stdout: %s", buf);
 }
 
+static void
+update_command_close_handler(connection_t *cptr)
+{
+	update_job_t *job = cptr->userdata;
+
+	if (job == NULL)
+		return;
+
+	if (job->out == cptr)
+		job->out = NULL;
+	else if (job->err == cptr)
+		job->err = NULL;
+}
+
 static void
 update_command_stdout_handler(connection_t *cptr)
 {
@@ -59,87 +290,683 @@ update_command_stderr_handler(connection_t *cptr)
 	update_command_recvq_handler(cptr, 1);
 }
 
+static uint64_t
+replica_hash(const char *data, size_t len, uint64_t hash)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= REPLICA_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static size_t
+replica_next_chunk(const char *data, size_t len)
+{
+	const char *nl;
+	size_t off = 0, end;
+
+	while (off < len)
+	{
+		nl = memchr(data + off, '\n', len - off);
+		end = nl != NULL ? (size_t) (nl - data) + 1 : len;
+
+		if ((replica_hash(data + off, end - off, REPLICA_FNV_OFFSET) & REPLICA_CHUNK_MASK) == 0 || end >= REPLICA_CHUNK_MAX)
+			return end;
+
+		off = end;
+	}
+
+	return off;
+}
+
 static void
-on_db_save(void *unused)
+replica_append(update_job_t *job, const char *data, size_t len)
 {
-	int stdout_pipes[2], stderr_pipes[2];
-	pid_t pid;
-	int errno1;
+	if (job->stream_len + len > job->stream_size)
+	{
+		while (job->stream_len + len > job->stream_size)
+			job->stream_size = job->stream_size ? job->stream_size * 2 : 65536;
+
+		job->stream = srealloc(job->stream, job->stream_size);
+	}
+
+	memcpy(job->stream + job->stream_len, data, len);
+	job->stream_len += len;
+}
+
+/* diffs the database just saved against the copy the receiver has */
+static bool
+build_replica_stream(update_job_t *job)
+{
+	const char *path = database_path ? database_path : DATADIR "/services.db";
+	char line[BUFSIZE], key[17];
+	char *data = NULL;
+	size_t len = 0, size = 0, off, chunk, n;
+	FILE *f;
+	int err;
+
+	if ((f = fopen(path, "rb")) == NULL)
+	{
+		err = errno;
+		slog(LG_ERROR, "ERROR: Couldn't read %s for replication: %s", path, strerror(err));
+		return false;
+	}
+
+	do
+	{
+		if (len == size)
+		{
+			size = size ? size * 2 : 1048576;
+			data = srealloc(data, size);
+		}
 
-	if (!command)
+		n = fread(data + len, 1, size - len, f);
+		len += n;
+	} while (n != 0);
+
+	if (ferror(f))
+	{
+		err = errno;
+		slog(LG_ERROR, "ERROR: Couldn't read %s for replication: %s", path, strerror(err));
+		fclose(f);
+		sfree(data);
+		return false;
+	}
+
+	fclose(f);
+
+	job->digest = replica_hash(data, len, REPLICA_FNV_OFFSET);
+	job->chunks = mowgli_patricia_create(NULL);
+
+	n = snprintf(line, sizeof line, "ATHEME-DBSYNC 1 %016" PRIx64 " %zu %016" PRIx64 "\n",
+			replica_chunks != NULL ? replica_digest : 0, len, job->digest);
+	replica_append(job, line, n);
+
+	for (off = 0; off < len; off += chunk)
+	{
+		chunk = replica_next_chunk(data + off, len - off);
+		snprintf(key, sizeof key, "%016" PRIx64, replica_hash(data + off, chunk, REPLICA_FNV_OFFSET));
+
+		if (replica_chunks != NULL && mowgli_patricia_retrieve(replica_chunks, key) != NULL)
+		{
+			n = snprintf(line, sizeof line, "C %s %zu\n", key, chunk);
+			replica_append(job, line, n);
+		}
+		else
+		{
+			n = snprintf(line, sizeof line, "L %zu\n", chunk);
+			replica_append(job, line, n);
+			replica_append(job, data + off, chunk);
+		}
+
+		mowgli_patricia_add(job->chunks, key, job);
+	}
+
+	replica_append(job, "E\n", 2);
+	sfree(data);
+
+	slog(LG_DEBUG, "on_db_save: replicating %zu bytes of %s in a %zu byte stream", len, path, job->stream_len);
+
+	return true;
+}
+
+static void
+replica_write_handler(connection_t *cptr)
+{
+	update_job_t *job = cptr->userdata;
+	ssize_t n;
+	int err;
+
+	if (job == NULL)
+	{
+		connection_close_soon(cptr);
 		return;
+	}
 
-	if (update_command_proc.running)
+	n = write(cptr->fd, job->stream + job->stream_off, job->stream_len - job->stream_off);
+
+	if (n < 0)
 	{
-		slog(LG_ERROR, "ERROR: database update command is still running");
+		err = errno;
+
+		if (err == EAGAIN || err == EINTR)
+			return;
+
+		slog(LG_ERROR, "ERROR: Couldn't write replication stream to %s: %s", job->argv[0], strerror(err));
+	}
+	else if ((job->stream_off += n) < job->stream_len)
 		return;
+
+	/* closing stdin tells the receiver the stream is over */
+	job->in = NULL;
+	connection_close_soon(cptr);
+}
+
+/*
+ * posix_spawn() does not copy the services address space the way fork()
+ * does, which matters for large networks; the child gets the two output
+ * pipes and none of our connections.
+ */
+static bool
+spawn_update_job(update_job_t *job)
+{
+	int stdin_pipes[2] = { -1, -1 }, stdout_pipes[2], stderr_pipes[2];
+	posix_spawn_file_actions_t actions;
+	mowgli_node_t *n;
+	int err;
+
+	if (job->replicate)
+	{
+		if (!build_replica_stream(job))
+			return false;
+
+		if (pipe(stdin_pipes) == -1)
+		{
+			err = errno;
+			slog(LG_ERROR, "ERROR: Couldn't create pipe for database replication: %s", strerror(err));
+			return false;
+		}
 	}
 
 	if (pipe(stdout_pipes) == -1)
 	{
-		int err = errno;
+		err = errno;
 		slog(LG_ERROR, "ERROR: Couldn't create pipe for database update command: %s", strerror(err));
-		return;
+		goto fail_stdin;
 	}
 
 	if (pipe(stderr_pipes) == -1)
 	{
-		int err = errno;
+		err = errno;
 		slog(LG_ERROR, "ERROR: Couldn't create pipe for database update command: %s", strerror(err));
 		close(stdout_pipes[0]);
 		close(stdout_pipes[1]);
+		goto fail_stdin;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+
+	MOWGLI_ITER_FOREACH(n, connection_list.head)
+	{
+		connection_t *cptr = n->data;
+
+		posix_spawn_file_actions_addclose(&actions, cptr->fd);
+	}
+
+	if (job->replicate)
+	{
+		posix_spawn_file_actions_addclose(&actions, stdin_pipes[1]);
+		posix_spawn_file_actions_adddup2(&actions, stdin_pipes[0], 0);
+		posix_spawn_file_actions_addclose(&actions, stdin_pipes[0]);
+	}
+
+	posix_spawn_file_actions_addclose(&actions, stdout_pipes[0]);
+	posix_spawn_file_actions_addclose(&actions, stderr_pipes[0]);
+	posix_spawn_file_actions_adddup2(&actions, stdout_pipes[1], 1);
+	posix_spawn_file_actions_adddup2(&actions, stderr_pipes[1], 2);
+	posix_spawn_file_actions_addclose(&actions, stdout_pipes[1]);
+	posix_spawn_file_actions_addclose(&actions, stderr_pipes[1]);
+
+	err = posix_spawnp(&job->pid, job->argv[0], &actions, NULL, job->argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(stdout_pipes[1]);
+	close(stderr_pipes[1]);
+
+	if (job->replicate)
+		close(stdin_pipes[0]);
+
+	if (err != 0)
+	{
+		slog(LG_ERROR, "ERROR: Couldn't start database update command %s: %s", job->argv[0], strerror(err));
+		close(stdout_pipes[0]);
+		close(stderr_pipes[0]);
+
+		if (job->replicate)
+			close(stdin_pipes[1]);
+
+		return false;
+	}
+
+	if (job->replicate)
+	{
+		job->in = connection_add("update_command_stdin", stdin_pipes[1], 0, NULL, replica_write_handler);
+		job->in->userdata = job;
+	}
+
+	job->out = connection_add("update_command_stdout", stdout_pipes[0], 0, recvq_put, NULL);
+	job->err = connection_add("update_command_stderr", stderr_pipes[0], 0, recvq_put, NULL);
+	job->out->recvq_handler = update_command_stdout_handler;
+	job->err->recvq_handler = update_command_stderr_handler;
+	job->out->close_handler = update_command_close_handler;
+	job->err->close_handler = update_command_close_handler;
+	job->out->userdata = job;
+	job->err->userdata = job;
+	childproc_add(job->pid, "db_update", update_command_finished, job);
+
+	job->started_ms = now_ms();
+	if (update_timeout != 0)
+		job->kill_timer = mowgli_timer_add_once(base_eventloop, "update_command_kill", update_command_kill, job, update_timeout);
+
+	return true;
+
+fail_stdin:
+	if (job->replicate)
+	{
+		close(stdin_pipes[0]);
+		close(stdin_pipes[1]);
+	}
+
+	return false;
+}
+
+/* starts queued commands up to the concurrency limit, and ends the run once all are done */
+static void
+start_update_jobs(void)
+{
+	update_job_t *job;
+
+	while (update_command_proc.next != NULL && update_command_proc.active < max_parallel)
+	{
+		job = update_command_proc.next->data;
+		update_command_proc.next = update_command_proc.next->next;
+
+		if (spawn_update_job(job))
+		{
+			update_command_proc.active++;
+			continue;
+		}
+
+		free_update_job(job);
+	}
+
+	if (update_command_proc.active != 0 || update_command_proc.next != NULL)
 		return;
+
+	update_command_proc.running = 0;
+
+	if (run_pending)
+	{
+		run_pending = false;
+		schedule_update_command();
 	}
+}
 
-	pid = fork();
+/*
+ * Fills in the placeholders of one argument:
+ *   %d  the database file
+ *   %t  the time of the save, in seconds since the epoch
+ *   %%  a literal %
+ */
+static char *
+expand_argument(const char *arg, time_t saved_at)
+{
+	char buf[BUFSIZE];
+	size_t len = 0;
+	const char *p;
 
-	switch (pid)
+	for (p = arg; *p != '\0' && len < sizeof buf - 1; p++)
 	{
-		case -1:
-			errno1 = errno;
-			slog(LG_ERROR, "Failed to fork for database update command: %s", strerror(errno1));
-			return;
-		case 0:
-			connection_close_all_fds();
-			close(stdout_pipes[0]);
-			close(stderr_pipes[0]);
-			dup2(stdout_pipes[1], 1);
-			dup2(stderr_pipes[1], 2);
-			close(stdout_pipes[1]);
-			close(stderr_pipes[1]);
-			execl("/bin/sh", "sh",  "-c", command, NULL);
-			write(2, "Failed to exec /bin/sh\n", 23);
-			_exit(255);
+		if (*p != '%' || p[1] == '\0')
+		{
+			buf[len++] = *p;
+			continue;
+		}
+
+		switch (*++p)
+		{
+			case 'd':
+				len += snprintf(buf + len, sizeof buf - len, "%s", database_path ? database_path : DATADIR "/services.db");
+				break;
+			case 't':
+				len += snprintf(buf + len, sizeof buf - len, "%lu", (unsigned long) saved_at);
+				break;
+			case '%':
+				buf[len++] = '%';
+				break;
+			default:
+				buf[len++] = '%';
+				if (len < sizeof buf - 1)
+					buf[len++] = *p;
+				break;
+		}
+
+		if (len > sizeof buf - 1)
+			len = sizeof buf - 1;
+	}
+
+	buf[len] = '\0';
+
+	return sstrdup(buf);
+}
+
+static update_job_t *
+queue_update_job(char **argv)
+{
+	update_job_t *job = scalloc(1, sizeof *job);
+
+	job->argv = argv;
+
+	mowgli_node_add(job, &job->node, &update_command_proc.jobs);
+
+	return job;
+}
+
+static char **
+expand_argv(char **template)
+{
+	char **argv;
+	unsigned int i;
+
+	for (i = 0; template[i] != NULL; i++)
+		;
+
+	argv = smalloc(sizeof *argv * (i + 1));
+
+	for (i = 0; template[i] != NULL; i++)
+		argv[i] = expand_argument(template[i], last_save);
+
+	argv[i] = NULL;
+
+	return argv;
+}
+
+static void
+run_update_command(void)
+{
+	mowgli_node_t *n;
+	char **argv;
+
+	if (!command && MOWGLI_LIST_LENGTH(&commands) == 0 && !replicate_argv)
+		return;
+
+	if (replicate_argv)
+		queue_update_job(expand_argv(replicate_argv))->replicate = true;
+
+	/* db_update_command is still run through the shell, as it always was */
+	if (command)
+	{
+		argv = smalloc(sizeof *argv * 4);
+		argv[0] = sstrdup("/bin/sh");
+		argv[1] = sstrdup("-c");
+		argv[2] = sstrdup(command);
+		argv[3] = NULL;
+		queue_update_job(argv);
+	}
+
+	MOWGLI_ITER_FOREACH(n, commands.head)
+		queue_update_job(expand_argv(n->data));
+
+	update_command_proc.next = update_command_proc.jobs.head;
+	update_command_proc.running = 1;
+	update_command_proc.saved_ms = last_save_ms;
+	last_run = CURRTIME;
+
+	start_update_jobs();
+}
+
+static void
+delayed_update_command(void *unused)
+{
+	delay_timer = NULL;
+	schedule_update_command();
+}
+
+/*
+ * Runs the command now if it may, otherwise makes sure it runs exactly
+ * once more: after the current run finishes, or once min_interval has
+ * passed since the last one started.
+ */
+static void
+schedule_update_command(void)
+{
+	if (update_command_proc.running)
+	{
+		slog(LG_DEBUG, "on_db_save: database update command is still running, will run it again afterwards");
+		run_pending = true;
+		return;
+	}
+
+	if (delay_timer != NULL)
+		return;
+
+	if (last_run + (time_t) min_interval > CURRTIME)
+	{
+		delay_timer = mowgli_timer_add_once(base_eventloop, "delayed_update_command", delayed_update_command, NULL,
+				last_run + min_interval - CURRTIME);
+		return;
+	}
+
+	run_update_command();
+}
+
+static void
+on_db_save(void *unused)
+{
+	if (!command && MOWGLI_LIST_LENGTH(&commands) == 0 && !replicate_argv)
+		return;
+
+	last_save = CURRTIME;
+	last_save_ms = now_ms();
+	schedule_update_command();
+}
+
+/*
+ * db_update_commands {
+ *	max_parallel = 2;
+ *	database = "/path/to/services.db";
+ *	command { "/usr/bin/rsync"; "-a"; "%d"; "standby:/srv/atheme/"; };
+ *	replicate { "ssh"; "standby"; "atheme-dbrecv"; "/srv/atheme/services.db"; };
+ * };
+ */
+static char **
+parse_argv(mowgli_config_file_entry_t *ce)
+{
+	mowgli_config_file_entry_t *arg;
+	char **argv;
+	unsigned int i = 0;
+
+	MOWGLI_ITER_FOREACH(arg, ce->entries)
+		i++;
+
+	if (i == 0)
+	{
+		conf_report_warning(ce, "%s has no arguments", ce->varname);
+		return NULL;
+	}
+
+	argv = smalloc(sizeof *argv * (i + 1));
+	i = 0;
+
+	MOWGLI_ITER_FOREACH(arg, ce->entries)
+		argv[i++] = sstrdup(arg->varname);
+
+	argv[i] = NULL;
+
+	return argv;
+}
+
+static int
+update_commands_config_handler(mowgli_config_file_entry_t *ce)
+{
+	mowgli_config_file_entry_t *cce;
+	char **argv;
+
+	MOWGLI_ITER_FOREACH(cce, ce->entries)
+	{
+		if (!strcasecmp(cce->varname, "max_parallel"))
+		{
+			if (cce->vardata == NULL || atoi(cce->vardata) <= 0)
+			{
+				conf_report_warning(cce, "max_parallel must be a positive number");
+				continue;
+			}
+
+			max_parallel = atoi(cce->vardata);
+		}
+		else if (!strcasecmp(cce->varname, "database"))
+		{
+			if (cce->vardata == NULL)
+			{
+				conf_report_warning(cce, "no database path specified");
+				continue;
+			}
+
+			sfree(database_path);
+			database_path = sstrdup(cce->vardata);
+		}
+		else if (!strcasecmp(cce->varname, "command"))
+		{
+			if ((argv = parse_argv(cce)) != NULL)
+				mowgli_node_add(argv, mowgli_node_create(), &commands);
+		}
+		else if (!strcasecmp(cce->varname, "replicate"))
+		{
+			if ((argv = parse_argv(cce)) == NULL)
+				continue;
+
+			if (replicate_argv)
+				free_argv(replicate_argv);
+
+			replicate_argv = argv;
+		}
+		else
+			conf_report_warning(cce, "unknown directive in db_update_commands");
+	}
+
+	return 0;
+}
+
+static void
+update_commands_config_purge(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, commands.head)
+	{
+		free_argv(n->data);
+		mowgli_node_delete(n, &commands);
+		mowgli_node_free(n);
+	}
+
+	if (replicate_argv)
+		free_argv(replicate_argv);
+
+	replicate_argv = NULL;
+	max_parallel = 1;
+	sfree(database_path);
+	database_path = NULL;
+}
+
+static void
+os_cmd_dbupdate(sourceinfo_t *si, int parc, char *parv[])
+{
+	struct update_record *rec;
+	unsigned int count = update_history_count, i;
+	char result[64];
+
+	if (parv[0] != NULL)
+	{
+		count = (unsigned int) atoi(parv[0]);
+
+		if (count == 0)
+		{
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "DBUPDATE");
+			command_fail(si, fault_badparams, _("Syntax: DBUPDATE [count]"));
 			return;
-		default:
-			close(stdout_pipes[1]);
-			close(stderr_pipes[1]);
-			update_command_proc.out = connection_add("update_command_stdout", stdout_pipes[0], 0, recvq_put, NULL);
-			update_command_proc.err = connection_add("update_command_stderr", stderr_pipes[0], 0, recvq_put, NULL);
-			update_command_proc.out->recvq_handler = update_command_stdout_handler;
-			update_command_proc.err->recvq_handler = update_command_stderr_handler;
-			update_command_proc.pid = pid;
-			update_command_proc.running = 1;
-			childproc_add(pid, "db_update", update_command_finished, NULL);
-			break;
+		}
+
+		if (count > update_history_count)
+			count = update_history_count;
 	}
+
+	if (update_command_proc.running)
+		command_success_nodata(si, _("Database update commands are running (%u started, %zu not yet finished)."),
+				update_command_proc.active, MOWGLI_LIST_LENGTH(&update_command_proc.jobs));
+	else
+		command_success_nodata(si, _("No database update commands are running."));
+
+	if (run_pending || delay_timer != NULL)
+		command_success_nodata(si, _("Another run is pending for the save made %s ago."), time_ago(last_save));
+
+	/* newest first */
+	for (i = 0; i < count; i++)
+	{
+		rec = &update_history[(update_history_next + UPDATE_HISTORY_SIZE - 1 - i) % UPDATE_HISTORY_SIZE];
+
+		if (rec->timed_out)
+			mowgli_strlcpy(result, _("timed out"), sizeof result);
+		else if (WIFSIGNALED(rec->status))
+			snprintf(result, sizeof result, _("signal %d"), WTERMSIG(rec->status));
+		else
+			snprintf(result, sizeof result, _("exit %d"), WEXITSTATUS(rec->status));
+
+		command_success_nodata(si, _("%u: \2%s\2 %s ago: launch %llums, ran %llums, %s, %zu bytes of output"),
+				i + 1, rec->name, time_ago(rec->started), rec->launch_ms, rec->run_ms, result, rec->output);
+	}
+
+	command_success_nodata(si, _("End of database update history."));
+	logcommand(si, CMDLOG_GET, "DBUPDATE");
 }
 
+static command_t os_dbupdate = {
+	.name           = "DBUPDATE",
+	.desc           = N_("Shows recent database update commands."),
+	.access         = PRIV_SERVER_AUSPEX,
+	.maxparc        = 1,
+	.cmd            = &os_cmd_dbupdate,
+	.help           = { .path = "contrib/dbupdate" },
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
 	hook_add_event("db_saved");
 	hook_add_db_saved(on_db_save);
 
+	hook_add_event("config_purge");
+	hook_add_config_purge(update_commands_config_purge);
+
 	add_dupstr_conf_item("db_update_command", &conf_gi_table, 0, &command, NULL);
+	add_duration_conf_item("db_update_min_interval", &conf_gi_table, 0, &min_interval, "s", 0);
+	add_duration_conf_item("db_update_timeout", &conf_gi_table, 0, &update_timeout, "s", 0);
+	add_conf_item("db_update_commands", &conf_gi_table, update_commands_config_handler);
+
+	service_named_bind_command("operserv", &os_dbupdate);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	hook_del_db_saved(on_db_save);
+	hook_del_config_purge(update_commands_config_purge);
 
 	del_conf_item("db_update_command", &conf_gi_table);
+	del_conf_item("db_update_min_interval", &conf_gi_table);
+	del_conf_item("db_update_timeout", &conf_gi_table);
+	del_conf_item("db_update_commands", &conf_gi_table);
+
+	service_named_unbind_command("operserv", &os_dbupdate);
+
+	if (delay_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, delay_timer);
+
+	childproc_delete_all(update_command_finished);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, update_command_proc.jobs.head)
+		free_update_job(n->data);
+
+	if (replica_chunks != NULL)
+		mowgli_patricia_destroy(replica_chunks, NULL, NULL);
+
+	update_commands_config_purge(NULL);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/on_db_save", MODULE_UNLOAD_CAPABILITY_OK)
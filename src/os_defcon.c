@@ -19,12 +19,106 @@ static int level = 5;
 static unsigned int defcon_timeout = 900;
 static mowgli_eventloop_timer_t *defcon_timer = NULL;
 
+/* channels visited per second while (un)setting DEFCON_CMODE */
+#define DEFCON_SWEEP_SLICE	500
+
+static struct {
+	mowgli_list_t queue;
+	bool set;
+	unsigned int total, done, changed;
+	mowgli_eventloop_timer_t *timer;
+} defcon_sweep;
+
+/* channels the sweep set DEFCON_CMODE on, the only ones a revert touches */
+static mowgli_patricia_t *defcon_changed = NULL;
+
+/*
+ * Events over the last DEFCON_RATE_WINDOW seconds, kept as one counter per
+ * second in a ring, so the rate costs the same memory at any volume.
+ */
+#define DEFCON_RATE_WINDOW	60
+
+typedef struct {
+	unsigned int slots[DEFCON_RATE_WINDOW];
+	unsigned int sum;
+	time_t last;
+} defcon_rate_t;
+
+static defcon_rate_t conn_rate;
+static defcon_rate_t reg_rate;
+
+/*
+ * The automatic controller raises the level to defcon_auto_level once
+ * either rate per minute reaches its threshold (0 disables that one), and
+ * lowers it again only after both have stayed under half their threshold
+ * for defcon_auto_cooldown. It then goes back to the level that was in
+ * effect before, so an operator's level keeps its own timeout.
+ */
+static bool defcon_auto = false;
+static unsigned int defcon_auto_conns = 0;
+static unsigned int defcon_auto_regs = 0;
+static unsigned int defcon_auto_level = 3;
+static unsigned int defcon_auto_cooldown = 300;
+static bool defcon_auto_raised = false;
+static int defcon_auto_prev = 5;
+static time_t defcon_auto_quiet = 0;
+static mowgli_eventloop_timer_t *defcon_auto_timer = NULL;
+
+static void defcon_auto_check(void);
+
+static void
+defcon_auto_stop(void)
+{
+	if (defcon_auto_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, defcon_auto_timer);
+
+	defcon_auto_timer = NULL;
+	defcon_auto_raised = false;
+}
+
+static void
+defcon_rate_advance(defcon_rate_t *r)
+{
+	time_t t;
+
+	if (CURRTIME - r->last >= DEFCON_RATE_WINDOW)
+	{
+		memset(r->slots, 0, sizeof r->slots);
+		r->sum = 0;
+	}
+	else
+	{
+		for (t = r->last + 1; t <= CURRTIME; t++)
+		{
+			r->sum -= r->slots[t % DEFCON_RATE_WINDOW];
+			r->slots[t % DEFCON_RATE_WINDOW] = 0;
+		}
+	}
+
+	r->last = CURRTIME;
+}
+
+static void
+defcon_rate_add(defcon_rate_t *r)
+{
+	defcon_rate_advance(r);
+	r->slots[CURRTIME % DEFCON_RATE_WINDOW]++;
+	r->sum++;
+}
+
 static void
 defcon_nouserreg(hook_user_register_check_t *hdata)
 {
 	return_if_fail(hdata != NULL);
 	return_if_fail(hdata->si != NULL);
 
+	/* attempts count even when refused, so a registration flood keeps the level up */
+	if (defcon_auto)
+	{
+		defcon_rate_add(&reg_rate);
+		defcon_auto_check();
+	}
+
 	if (level < 5)
 	{
 		command_fail(hdata->si, fault_badparams, _("Registrations are currently disabled on this network, please try again later."));
@@ -57,6 +151,13 @@ defcon_useradd(hook_user_nick_t *data)
 	if (is_internal_client(u))
 		return;
 
+	/* users introduced by a netjoin are not new connections */
+	if (defcon_auto && (u->server->flags & SF_EOB))
+	{
+		defcon_rate_add(&conn_rate);
+		defcon_auto_check();
+	}
+
 	if (level == 1)
 	{
 		slog(LG_INFO, "DEFCON:KLINE: %s!%s@%s", u->nick, u->user, u->host);
@@ -103,35 +204,127 @@ defcon_svsignore(void)
 	}
 }
 
+/*
+ * Sets or clears DEFCON_CMODE on channels one slice per second, so a level
+ * change does not turn into a single burst of MODEs for the whole network.
+ * Channels that already have the mode are left alone when setting it, and
+ * only channels the sweep changed are reverted.
+ */
 static void
-defcon_forcechanmodes(void)
+defcon_sweep_cancel(void)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, defcon_sweep.queue.head)
+	{
+		sfree(n->data);
+		mowgli_node_delete(n, &defcon_sweep.queue);
+		mowgli_node_free(n);
+	}
+
+	if (defcon_sweep.timer != NULL)
+		mowgli_timer_destroy(base_eventloop, defcon_sweep.timer);
+
+	defcon_sweep.timer = NULL;
+}
+
+static void
+defcon_sweep_step(void *unused)
 {
+	service_t *svs = service_find("operserv");
+	unsigned int flag = mode_to_flag(*DEFCON_CMODE);
+	unsigned int i;
+	mowgli_node_t *n;
 	channel_t *chptr;
-	mowgli_patricia_iteration_state_t state;
-	service_t *svs;
-	char modesetbuf[256];
-	char modeunsetbuf[256];
+	char *name;
 
-	svs = service_find("operserv");
+	defcon_sweep.timer = NULL;
 
-	if (level <= 3)
+	for (i = 0; i < DEFCON_SWEEP_SLICE && (n = defcon_sweep.queue.head) != NULL; i++)
 	{
-		snprintf(modesetbuf, sizeof modesetbuf, "+%s", DEFCON_CMODE);
-		slog(LG_INFO, "DEFCON:MODE: %s", modesetbuf);
-		MOWGLI_PATRICIA_FOREACH(chptr, &state, chanlist)
+		name = n->data;
+		mowgli_node_delete(n, &defcon_sweep.queue);
+		mowgli_node_free(n);
+
+		chptr = channel_find(name);
+		sfree(name);
+		defcon_sweep.done++;
+
+		if (chptr == NULL)
+			continue;
+
+		if (defcon_sweep.set)
 		{
-			channel_mode_va(svs->me, chptr, 1, modesetbuf);
+			if (flag != 0 && (chptr->modes & flag))
+				continue;
+
+			channel_mode_va(svs->me, chptr, 1, "+%s", DEFCON_CMODE);
+			mowgli_patricia_add(defcon_changed, chptr->name, chptr);
+		}
+		else
+		{
+			mowgli_patricia_delete(defcon_changed, chptr->name);
+
+			if (flag != 0 && !(chptr->modes & flag))
+				continue;
+
+			channel_mode_va(svs->me, chptr, 1, "-%s", DEFCON_CMODE);
 		}
+
+		defcon_sweep.changed++;
+	}
+
+	if (MOWGLI_LIST_LENGTH(&defcon_sweep.queue) != 0)
+	{
+		defcon_sweep.timer = mowgli_timer_add_once(base_eventloop, "defcon_sweep", defcon_sweep_step, NULL, 1);
+		return;
 	}
-	else if (level >= 4)
+
+	slog(LG_INFO, "DEFCON:MODE: %s%s done (%u of %u channels changed)", defcon_sweep.set ? "+" : "-", DEFCON_CMODE,
+			defcon_sweep.changed, defcon_sweep.total);
+}
+
+static void
+defcon_forcechanmodes(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	channel_t *chptr;
+	bool set = level <= 3;
+
+	/* nothing to revert, or the mode is already on its way */
+	if (!set && mowgli_patricia_size(defcon_changed) == 0 && defcon_sweep.timer == NULL)
+		return;
+
+	if (set && defcon_sweep.set && defcon_sweep.timer != NULL)
+		return;
+
+	defcon_sweep_cancel();
+
+	defcon_sweep.set = set;
+	defcon_sweep.done = defcon_sweep.changed = 0;
+
+	/* queue names rather than pointers, as channels can vanish between slices */
+	if (set)
 	{
-		snprintf(modeunsetbuf, sizeof modeunsetbuf, "-%s", DEFCON_CMODE);
-		slog(LG_INFO, "DEFCON:MODE: %s", modeunsetbuf);
 		MOWGLI_PATRICIA_FOREACH(chptr, &state, chanlist)
-		{
-			channel_mode_va(svs->me, chptr, 1, modeunsetbuf);
-		}
+			mowgli_node_add(sstrdup(chptr->name), mowgli_node_create(), &defcon_sweep.queue);
+	}
+	else
+	{
+		MOWGLI_PATRICIA_FOREACH(chptr, &state, defcon_changed)
+			mowgli_node_add(sstrdup(chptr->name), mowgli_node_create(), &defcon_sweep.queue);
 	}
+
+	defcon_sweep.total = MOWGLI_LIST_LENGTH(&defcon_sweep.queue);
+	slog(LG_INFO, "DEFCON:MODE: %s%s on %u channels", set ? "+" : "-", DEFCON_CMODE, defcon_sweep.total);
+
+	defcon_sweep_step(NULL);
+}
+
+static void
+defcon_channel_delete(channel_t *chptr)
+{
+	mowgli_patricia_delete(defcon_changed, chptr->name);
 }
 
 static void
@@ -142,6 +335,16 @@ defcon_timeoutfunc(void *dummy)
 
 	svs = service_find("operserv");
 
+	defcon_timer = NULL;
+
+	/* the controller is still holding the level up; it returns to 5 when it decays */
+	if (defcon_auto_raised)
+	{
+		defcon_auto_prev = 5;
+		slog(LG_INFO, "DEFCON:TIMEOUT: deferred to automatic level %d", level);
+		return;
+	}
+
 	level = 5;
 	defcon_svsignore();
 	defcon_forcechanmodes();
@@ -151,6 +354,89 @@ defcon_timeoutfunc(void *dummy)
 	notice_global_sts(svs->me, "*", buf);
 }
 
+static bool
+defcon_auto_over(unsigned int rate, unsigned int threshold, unsigned int divisor)
+{
+	return threshold != 0 && rate * divisor >= threshold;
+}
+
+static void
+defcon_auto_set(int newlevel, const char *why)
+{
+	service_t *svs = service_find("operserv");
+	char buf[BUFSIZE];
+
+	level = newlevel;
+	defcon_svsignore();
+	defcon_forcechanmodes();
+	slog(LG_INFO, "DEFCON:AUTO: %d (%s)", level, why);
+
+	if (level < 5)
+		snprintf(buf, sizeof buf, "The DEFCON level has been changed to \2%d\2. We apologize for any inconvenience.", level);
+	else
+		snprintf(buf, sizeof buf, "The DEFCON level is now back to normal (\2%d\2). Sorry for any inconvenience this caused.", level);
+
+	notice_global_sts(svs->me, "*", buf);
+	wallops("Defense condition automatically set to level \2%d\2 (%s).", level, why);
+}
+
+/*
+ * Runs every 10 seconds while the level is automatically raised, to bring
+ * it back down; it re-arms itself until the cooldown has passed.
+ */
+static void
+defcon_auto_decay(void *unused)
+{
+	char why[BUFSIZE];
+
+	defcon_auto_timer = NULL;
+
+	defcon_rate_advance(&conn_rate);
+	defcon_rate_advance(&reg_rate);
+
+	if (defcon_auto_over(conn_rate.sum, defcon_auto_conns, 2) || defcon_auto_over(reg_rate.sum, defcon_auto_regs, 2))
+		defcon_auto_quiet = 0;
+	else if (defcon_auto_quiet == 0)
+		defcon_auto_quiet = CURRTIME;
+
+	if (defcon_auto_quiet == 0 || CURRTIME - defcon_auto_quiet < (time_t) defcon_auto_cooldown)
+	{
+		defcon_auto_timer = mowgli_timer_add_once(base_eventloop, "defcon_auto_decay", defcon_auto_decay, NULL, 10);
+		return;
+	}
+
+	snprintf(why, sizeof why, "rates back to normal for %u seconds", defcon_auto_cooldown);
+
+	defcon_auto_raised = false;
+
+	defcon_auto_set(defcon_auto_prev, why);
+}
+
+static void
+defcon_auto_check(void)
+{
+	char why[BUFSIZE];
+
+	if (level <= (int) defcon_auto_level)
+		return;
+
+	if (defcon_auto_over(conn_rate.sum, defcon_auto_conns, 1))
+		snprintf(why, sizeof why, "%u connections in the last minute", conn_rate.sum);
+	else if (defcon_auto_over(reg_rate.sum, defcon_auto_regs, 1))
+		snprintf(why, sizeof why, "%u registration attempts in the last minute", reg_rate.sum);
+	else
+		return;
+
+	defcon_auto_prev = level;
+	defcon_auto_raised = true;
+	defcon_auto_quiet = 0;
+
+	if (defcon_auto_timer == NULL)
+		defcon_auto_timer = mowgli_timer_add_once(base_eventloop, "defcon_auto_decay", defcon_auto_decay, NULL, 10);
+
+	defcon_auto_set((int) defcon_auto_level, why);
+}
+
 static void
 os_cmd_defcon(sourceinfo_t *si, int parc, char *parv[])
 {
@@ -159,7 +445,21 @@ os_cmd_defcon(sourceinfo_t *si, int parc, char *parv[])
 
 	if (!defcon)
 	{
-		command_success_nodata(si, _("Defense condition is currently level \2%d\2."), level);
+		command_success_nodata(si, _("Defense condition is currently level \2%d\2%s."), level,
+				defcon_auto_raised ? " (set automatically)" : "");
+
+		if (defcon_auto)
+		{
+			defcon_rate_advance(&conn_rate);
+			defcon_rate_advance(&reg_rate);
+			command_success_nodata(si, _("Last minute: \2%u\2 connections, \2%u\2 registration attempts."),
+					conn_rate.sum, reg_rate.sum);
+		}
+
+		if (defcon_sweep.timer != NULL)
+			command_success_nodata(si, _("Channel modes are being %s: \2%u\2 of \2%u\2 channels done, \2%u\2 changed."),
+					defcon_sweep.set ? "set" : "reverted", defcon_sweep.done, defcon_sweep.total, defcon_sweep.changed);
+
 		return;
 	}
 
@@ -172,6 +472,9 @@ os_cmd_defcon(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
+	/* an operator's choice overrides the controller until it raises the level again */
+	defcon_auto_stop();
+
 	/* Call the 2 functions that don't use hooks */
 	defcon_svsignore();
 	defcon_forcechanmodes();
@@ -187,7 +490,8 @@ os_cmd_defcon(sourceinfo_t *si, int parc, char *parv[])
 	{
 		snprintf(buf, sizeof buf, "The DEFCON level is now back to normal (\2%d\2). Sorry for any inconvenience this caused.", level);
 
-		mowgli_timer_destroy(base_eventloop, defcon_timer);
+		if (defcon_timer != NULL)
+			mowgli_timer_destroy(base_eventloop, defcon_timer);
 		defcon_timer = NULL;
 	}
 
@@ -220,10 +524,19 @@ mod_init(module_t *const restrict m)
 	hook_add_channel_can_register(defcon_nochanreg);
 	hook_add_event("user_add");
 	hook_add_user_add(defcon_useradd);
+	hook_add_event("channel_delete");
+	hook_add_channel_delete(defcon_channel_delete);
+
+	defcon_changed = mowgli_patricia_create(irccasecanon);
 
 	service_t *svs;
 	svs = service_find("operserv");
 	add_duration_conf_item("DEFCON_TIMEOUT", &svs->conf_table, 0, &defcon_timeout, "m", 900);
+	add_bool_conf_item("DEFCON_AUTO", &svs->conf_table, 0, &defcon_auto, false);
+	add_uint_conf_item("DEFCON_AUTO_CONNECTIONS", &svs->conf_table, 0, &defcon_auto_conns, 0, INT_MAX, 0);
+	add_uint_conf_item("DEFCON_AUTO_REGISTRATIONS", &svs->conf_table, 0, &defcon_auto_regs, 0, INT_MAX, 0);
+	add_uint_conf_item("DEFCON_AUTO_LEVEL", &svs->conf_table, 0, &defcon_auto_level, 1, 4, 3);
+	add_duration_conf_item("DEFCON_AUTO_COOLDOWN", &svs->conf_table, 0, &defcon_auto_cooldown, "s", 300);
 }
 
 static void
@@ -234,13 +547,24 @@ mod_deinit(const module_unload_intent_t intent)
 	hook_del_user_can_register(defcon_nouserreg);
 	hook_del_channel_can_register(defcon_nochanreg);
 	hook_del_user_add(defcon_useradd);
+	hook_del_channel_delete(defcon_channel_delete);
 
 	service_t *svs;
 	svs = service_find("operserv");
 	del_conf_item("DEFCON_TIMEOUT", &svs->conf_table);
+	del_conf_item("DEFCON_AUTO", &svs->conf_table);
+	del_conf_item("DEFCON_AUTO_CONNECTIONS", &svs->conf_table);
+	del_conf_item("DEFCON_AUTO_REGISTRATIONS", &svs->conf_table);
+	del_conf_item("DEFCON_AUTO_LEVEL", &svs->conf_table);
+	del_conf_item("DEFCON_AUTO_COOLDOWN", &svs->conf_table);
+
+	defcon_auto_stop();
 
 	if (defcon_timer != NULL)
 		mowgli_timer_destroy(base_eventloop, defcon_timer);
+
+	defcon_sweep_cancel();
+	mowgli_patricia_destroy(defcon_changed, NULL, NULL);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_defcon", MODULE_UNLOAD_CAPABILITY_OK)
@@ -7,32 +7,346 @@
 
 #include "atheme-compat.h"
 
+/*
+ * Patterns are sorted by shape when they are added, so a join only has to
+ * run match() against the patterns that are neither a plain nick nor a
+ * literal prefix followed by a single '*'.
+ */
+typedef enum {
+	JM_EXACT,
+	JM_PREFIX,
+	JM_GLOB,
+} joinmon_kind_t;
+
 struct joinmon_ {
 	char *user;
 	/* This module is Jamaican...mon. */
 	time_t mon_ts;
 	char *creator;
 	char *reason;
+	joinmon_kind_t kind;
+	mowgli_node_t globnode;
 };
 
 typedef struct joinmon_ joinmon_t;
 
-static mowgli_list_t os_monlist = { NULL, NULL, 0 };
+/*
+ * What a user's current nick matched, valid while generation is current,
+ * and where the user sits in the burst queue (plus one, 0 if not queued).
+ */
+typedef struct {
+	joinmon_t *match;
+	unsigned int generation;
+	size_t burst_slot;
+} joinmon_cache_t;
+
+#define JOINMON_LIST_PAGE	50U
+
+/* every entry, keyed by its pattern under the IRC casemapping */
+static mowgli_patricia_t *jm_patterns = NULL;
+static mowgli_heap_t *jm_heap = NULL;
+
+static mowgli_patricia_t *jm_exact = NULL;
+static mowgli_patricia_t *jm_prefix = NULL;
+static mowgli_list_t jm_globs = { NULL, NULL, 0 };
+
+/* bumped whenever the pattern set changes, which invalidates every cached result */
+static unsigned int jm_generation = 1;
+
+/*
+ * Users who joined channels while their server was still bursting, each
+ * queued once; they are checked when the burst ends, against whatever
+ * channels they are in by then.
+ */
+static user_t **jm_burst = NULL;
+static size_t jm_burst_len = 0;
+static size_t jm_burst_size = 0;
+
+static joinmon_kind_t
+joinmon_classify(const char *pattern)
+{
+	size_t len = strlen(pattern);
+
+	if (strpbrk(pattern, "*?") == NULL)
+		return JM_EXACT;
+
+	if (len > 1 && pattern[len - 1] == '*' && strpbrk(pattern, "*?") == pattern + len - 1)
+		return JM_PREFIX;
+
+	return JM_GLOB;
+}
 
 static void
-write_jmdb(database_handle_t *db)
+joinmon_index(joinmon_t *l)
+{
+	char prefix[BUFSIZE];
+
+	l->kind = joinmon_classify(l->user);
+
+	switch (l->kind)
+	{
+	case JM_EXACT:
+		mowgli_patricia_add(jm_exact, l->user, l);
+		break;
+	case JM_PREFIX:
+		mowgli_strlcpy(prefix, l->user, sizeof prefix);
+		prefix[strlen(prefix) - 1] = '\0';
+		mowgli_patricia_add(jm_prefix, prefix, l);
+		break;
+	case JM_GLOB:
+		mowgli_node_add(l, &l->globnode, &jm_globs);
+		break;
+	}
+
+	jm_generation++;
+}
+
+static void
+joinmon_unindex(joinmon_t *l)
+{
+	char prefix[BUFSIZE];
+
+	switch (l->kind)
+	{
+	case JM_EXACT:
+		mowgli_patricia_delete(jm_exact, l->user);
+		break;
+	case JM_PREFIX:
+		mowgli_strlcpy(prefix, l->user, sizeof prefix);
+		prefix[strlen(prefix) - 1] = '\0';
+		mowgli_patricia_delete(jm_prefix, prefix);
+		break;
+	case JM_GLOB:
+		mowgli_node_delete(&l->globnode, &jm_globs);
+		break;
+	}
+
+	jm_generation++;
+}
+
+static joinmon_t *
+joinmon_create(const char *pattern, time_t mon_ts, const char *creator, const char *reason)
+{
+	joinmon_t *l;
+
+	if (mowgli_patricia_retrieve(jm_patterns, pattern) != NULL)
+		return NULL;
+
+	l = mowgli_heap_alloc(jm_heap);
+	l->user = sstrdup(pattern);
+	l->mon_ts = mon_ts;
+	l->creator = sstrdup(creator);
+	l->reason = reason != NULL ? sstrdup(reason) : NULL;
+
+	mowgli_patricia_add(jm_patterns, l->user, l);
+	joinmon_index(l);
+
+	return l;
+}
+
+static void
+joinmon_destroy(joinmon_t *l)
+{
+	joinmon_unindex(l);
+	mowgli_patricia_delete(jm_patterns, l->user);
+
+	sfree(l->user);
+	sfree(l->creator);
+	sfree(l->reason);
+	mowgli_heap_free(jm_heap, l);
+}
+
+/* exact nicks first, then the longest matching prefix, then the remaining globs */
+static joinmon_t *
+joinmon_lookup(const char *nick)
+{
+	char buf[BUFSIZE];
+	mowgli_node_t *n;
+	joinmon_t *l;
+	size_t len;
+
+	if ((l = mowgli_patricia_retrieve(jm_exact, nick)) != NULL)
+		return l;
+
+	if (mowgli_patricia_size(jm_prefix) != 0)
+	{
+		mowgli_strlcpy(buf, nick, sizeof buf);
+
+		for (len = strlen(buf); len > 0; len--)
+		{
+			buf[len] = '\0';
+
+			if ((l = mowgli_patricia_retrieve(jm_prefix, buf)) != NULL)
+				return l;
+		}
+	}
+
+	MOWGLI_ITER_FOREACH(n, jm_globs.head)
+	{
+		l = n->data;
+
+		/* Use match so you can monitor patterns like SomeBot* or
+		 * t???h?????1
+		 */
+		if (!match(l->user, nick))
+			return l;
+	}
+
+	return NULL;
+}
+
+static joinmon_cache_t *
+joinmon_cache(user_t *u)
+{
+	joinmon_cache_t *cache = privatedata_get(u, "joinmon:cache");
+
+	if (cache == NULL)
+	{
+		cache = scalloc(1, sizeof *cache);
+		privatedata_set(u, "joinmon:cache", cache);
+	}
+
+	return cache;
+}
+
+static joinmon_t *
+joinmon_match_user(user_t *u)
+{
+	joinmon_cache_t *cache = joinmon_cache(u);
+
+	if (cache->generation != jm_generation)
+	{
+		cache->match = joinmon_lookup(u->nick);
+		cache->generation = jm_generation;
+	}
+
+	return cache->match;
+}
+
+static void
+joinmon_nickchange(hook_user_nick_t *data)
+{
+	joinmon_cache_t *cache = privatedata_get(data->u, "joinmon:cache");
+
+	if (cache != NULL)
+		cache->generation = 0;
+}
+
+static void
+joinmon_user_delete(user_t *u)
 {
+	joinmon_cache_t *cache = privatedata_delete(u, "joinmon:cache");
+
+	if (cache != NULL && cache->burst_slot != 0)
+		jm_burst[cache->burst_slot - 1] = NULL;
+
+	sfree(cache);
+}
+
+static void
+joinmon_queue_burst(user_t *u)
+{
+	joinmon_cache_t *cache = joinmon_cache(u);
+
+	if (cache->burst_slot != 0)
+		return;
+
+	if (jm_burst_len == jm_burst_size)
+	{
+		jm_burst_size = jm_burst_size ? jm_burst_size * 2 : 256;
+		jm_burst = srealloc(jm_burst, jm_burst_size * sizeof *jm_burst);
+	}
+
+	jm_burst[jm_burst_len++] = u;
+	cache->burst_slot = jm_burst_len;
+}
+
+/* one line per matching user, listing every channel it ended up in */
+static void
+joinmon_report_burst(user_t *u, joinmon_t *l)
+{
+	char buf[BUFSIZE];
 	mowgli_node_t *n;
+	size_t len = 0;
+
+	buf[0] = '\0';
+
+	MOWGLI_ITER_FOREACH(n, u->channels.head)
+	{
+		chanuser_t *cu = n->data;
+
+		if (len + strlen(cu->chan->name) + 6 >= sizeof buf - 64)
+		{
+			mowgli_strlcat(buf, ", ...", sizeof buf);
+			break;
+		}
+
+		if (len != 0)
+			mowgli_strlcat(buf, ", ", sizeof buf);
 
-	MOWGLI_ITER_FOREACH(n, os_monlist.head)
+		mowgli_strlcat(buf, cu->chan->name, sizeof buf);
+		len = strlen(buf);
+	}
+
+	if (len == 0)
+		return;
+
+	slog(LG_INFO, "JOINMON: \2%s\2 who matches \2%s\2 joined \2%s\2 during a netjoin",
+			u->nick, l->user, buf);
+}
+
+/* checks the queued users whose servers have finished bursting, keeps the rest */
+static void
+joinmon_server_eob(server_t *s)
+{
+	joinmon_cache_t *cache;
+	joinmon_t *l;
+	user_t *u;
+	size_t i, kept = 0;
+
+	for (i = 0; i < jm_burst_len; i++)
 	{
-		joinmon_t *l = n->data;
+		if ((u = jm_burst[i]) == NULL)
+			continue;
+
+		cache = joinmon_cache(u);
+
+		if (!(u->server->flags & SF_EOB))
+		{
+			jm_burst[kept++] = u;
+			cache->burst_slot = kept;
+			continue;
+		}
+
+		cache->burst_slot = 0;
+
+		if ((l = joinmon_match_user(u)) != NULL)
+			joinmon_report_burst(u, l);
+	}
+
+	jm_burst_len = kept;
+
+	if (jm_burst_len == 0)
+	{
+		sfree(jm_burst);
+		jm_burst = NULL;
+		jm_burst_size = 0;
+	}
+}
+
+static void
+write_jmdb(database_handle_t *db)
+{
+	mowgli_patricia_iteration_state_t state;
+	joinmon_t *l;
 
+	MOWGLI_PATRICIA_FOREACH(l, &state, jm_patterns)
+	{
 		db_start_row(db, "JM");
 		db_write_word(db, l->user);
 		db_write_time(db, l->mon_ts);
 		db_write_word(db, l->creator);
-		db_write_str(db, l->reason);
+		db_write_str(db, l->reason != NULL ? l->reason : "None");
 		db_commit_row(db);
 	}
 }
@@ -45,45 +359,35 @@ db_h_jm(database_handle_t *db, const char *type)
 	const char *creator = db_sread_word(db);
 	const char *reason = db_sread_str(db);
 
-	joinmon_t *l = smalloc(sizeof(joinmon_t));
-	l->user = sstrdup(user);
-	l->mon_ts = mon_ts;
-	l->creator = sstrdup(creator);
-	l->reason = sstrdup(reason);
-	mowgli_node_add(l, mowgli_node_create(), &os_monlist);
+	if (joinmon_create(user, mon_ts, creator, reason) == NULL)
+		slog(LG_DEBUG, "db_h_jm: ignoring duplicate pattern %s", user);
 }
 
 static void
 watch_user_joins(hook_channel_joinpart_t *hdata)
 {
-	mowgli_node_t *n;
 	chanuser_t *cu = hdata->cu;
 	joinmon_t *l;
 
 	if (cu == NULL)
 		return;
 
+	/* not worth a lookup per join during a burst; the user is checked once it ends */
 	if (!(cu->user->server->flags & SF_EOB))
+	{
+		joinmon_queue_burst(cu->user);
 		return;
+	}
 
-	MOWGLI_ITER_FOREACH(n, os_monlist.head)
+	if ((l = joinmon_match_user(cu->user)) != NULL)
 	{
-		l = n->data;
-
-		/* Use match so you can monitor patterns like SomeBot* or
-		 * t???h?????1
+		/* Use LG_INFO because there's really no better logtype and creating
+		 * one just for this module (ie: having to put stuff in core) is
+		 * kind of stupid. Give it it's own logtype if logtypes are ever
+		 * addable by modules.
 		 */
-		if (!match(l->user, cu->user->nick))
-		{
-			/* Use LG_INFO because there's really no better logtype and creating
-			 * one just for this module (ie: having to put stuff in core) is
-			 * kind of stupid. Give it it's own logtype if logtypes are ever
-			 * addable by modules.
-			 */
-			slog(LG_INFO, "JOINMON: \2%s\2 who matches \2%s\2 has joined \2%s\2",
-					cu->user->nick, l->user, cu->chan->name);
-			return;
-		}
+		slog(LG_INFO, "JOINMON: \2%s\2 who matches \2%s\2 has joined \2%s\2",
+				cu->user->nick, l->user, cu->chan->name);
 	}
 }
 
@@ -93,7 +397,6 @@ os_cmd_joinmon(sourceinfo_t *si, int parc, char *parv[])
 	char *action = parv[0];
 	char *pattern = parv[1];
 	char *reason = parv[2];
-	mowgli_node_t *n, *tn;
 	joinmon_t *l;
 
 	if (!action)
@@ -118,36 +421,16 @@ os_cmd_joinmon(sourceinfo_t *si, int parc, char *parv[])
 			return;
 		}
 
-		/* search for it */
-		MOWGLI_ITER_FOREACH(n, os_monlist.head)
+		if (joinmon_create(pattern, CURRTIME, get_source_name(si), reason) == NULL)
 		{
-			l = n->data;
-
-			if (!irccasecmp(l->user, pattern))
-			{
-				command_success_nodata(si, _("Pattern \2%s\2 is already being monitored."), pattern);
-				return;
-			}
+			command_success_nodata(si, _("Pattern \2%s\2 is already being monitored."), pattern);
+			return;
 		}
 
-		l = smalloc(sizeof(joinmon_t));
-		l->user = sstrdup(pattern);
-		l->mon_ts = CURRTIME;;
-		l->creator = sstrdup(get_source_name(si));
-
 		if (reason)
-		{
-			l->reason = sstrdup(reason);
 			logcommand(si, CMDLOG_ADMIN, "JOINMON:ADD: \2%s\2 (Reason: \2%s\2)", pattern, reason);
-		}
 		else
-		{
-			l->reason = _("None");
 			logcommand(si, CMDLOG_ADMIN, "JOINMON:ADD: \2%s\2", pattern);
-		}
-
-		n = mowgli_node_create();
-		mowgli_node_add(l, n, &os_monlist);
 
 		command_success_nodata(si, _("\2%s\2 is now being monitored."), pattern);
 		return;
@@ -161,43 +444,57 @@ os_cmd_joinmon(sourceinfo_t *si, int parc, char *parv[])
 			return;
 		}
 
-		MOWGLI_ITER_FOREACH_SAFE(n, tn, os_monlist.head)
+		if ((l = mowgli_patricia_retrieve(jm_patterns, pattern)) != NULL)
 		{
-			l = n->data;
-
-			if (!irccasecmp(l->user, pattern))
-			{
-				logcommand(si, CMDLOG_ADMIN, "JOINMON:DEL: \2%s\2", l->user);
-
-				mowgli_node_delete(n, &os_monlist);
-
-				sfree(l->user);
-				sfree(l->creator);
-				sfree(l->reason);
-				sfree(l);
-
-				return;
-			}
+			logcommand(si, CMDLOG_ADMIN, "JOINMON:DEL: \2%s\2", l->user);
+			joinmon_destroy(l);
+			return;
 		}
+
 		command_success_nodata(si, _("Pattern \2%s\2 not found in joinmon database."), pattern);
 		return;
 	}
 	else if (!strcasecmp("LIST", action))
 	{
+		mowgli_patricia_iteration_state_t state;
+		const char *filter = pattern != NULL ? pattern : "*";
+		unsigned int page = 1, matches = 0, first, last;
 		char buf[BUFSIZE];
 		struct tm tm;
 
-		MOWGLI_ITER_FOREACH(n, os_monlist.head)
+		/* JOINMON LIST [filter] [page]; entries come out in key order, so pages are stable */
+		if (parv[2] != NULL && (page = (unsigned int) atoi(parv[2])) == 0)
 		{
-			l = n->data;
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "JOINMON");
+			command_fail(si, fault_badparams, _("Syntax: JOINMON LIST [filter] [page]"));
+			return;
+		}
+
+		first = (page - 1) * JOINMON_LIST_PAGE;
+		last = first + JOINMON_LIST_PAGE;
 
-			tm = *localtime(&l->mon_ts);
-			strftime(buf, BUFSIZE, TIME_FORMAT, &tm);
-			command_success_nodata(si, "Pattern: \2%s\2, Reason: \2%s\2 (%s - %s)",
-				l->user, l->reason, l->creator, buf);
+		MOWGLI_PATRICIA_FOREACH(l, &state, jm_patterns)
+		{
+			if (match(filter, l->user))
+				continue;
+
+			if (matches >= first && matches < last)
+			{
+				tm = *localtime(&l->mon_ts);
+				strftime(buf, BUFSIZE, TIME_FORMAT, &tm);
+				command_success_nodata(si, "Pattern: \2%s\2, Reason: \2%s\2 (%s - %s)",
+					l->user, l->reason != NULL ? l->reason : _("None"), l->creator, buf);
+			}
+
+			matches++;
 		}
-		command_success_nodata(si, "End of list.");
-		logcommand(si, CMDLOG_GET, "JOINMON:LIST");
+
+		if (matches > last)
+			command_success_nodata(si, _("Page %u of %u; use \2JOINMON LIST %s %u\2 for more."),
+				page, (matches + JOINMON_LIST_PAGE - 1) / JOINMON_LIST_PAGE, filter, page + 1);
+
+		command_success_nodata(si, _("End of list (%u matching pattern(s))."), matches);
+		logcommand(si, CMDLOG_GET, "JOINMON:LIST: \2%s\2", filter);
 		return;
 	}
 	else
@@ -226,8 +523,19 @@ mod_init(module_t *const restrict m)
 		return;
 	}
 
+	jm_heap = mowgli_heap_create(sizeof(joinmon_t), 256, BH_NOW);
+	jm_patterns = mowgli_patricia_create(irccasecanon);
+	jm_exact = mowgli_patricia_create(irccasecanon);
+	jm_prefix = mowgli_patricia_create(irccasecanon);
+
 	hook_add_event("channel_join");
 	hook_add_channel_join(watch_user_joins);
+	hook_add_event("user_nickchange");
+	hook_add_user_nickchange(joinmon_nickchange);
+	hook_add_event("user_delete");
+	hook_add_user_delete(joinmon_user_delete);
+	hook_add_event("server_eob");
+	hook_add_server_eob(joinmon_server_eob);
 	hook_add_db_write(write_jmdb);
 
 	db_register_type_handler("JM", db_h_jm);
@@ -239,6 +547,9 @@ static void
 mod_deinit(const module_unload_intent_t intent)
 {
 	hook_del_channel_join(watch_user_joins);
+	hook_del_user_nickchange(joinmon_nickchange);
+	hook_del_user_delete(joinmon_user_delete);
+	hook_del_server_eob(joinmon_server_eob);
 	hook_del_db_write(write_jmdb);
 
 	db_unregister_type_handler("JM");
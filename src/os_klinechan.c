@@ -9,30 +9,300 @@
 
 #include "atheme-compat.h"
 
+#include <arpa/inet.h>
+
+/* how long klines are held back so a join flood is sent as a few of them */
+#define KLINECHAN_FLUSH_DELAY	2
+
+/*
+ * The channels with private:klinechan:closer set, so joins to every other
+ * channel are dismissed without a metadata lookup. The metadata is only
+ * there once the database is loaded, so the set is built on first use.
+ */
+static mowgli_list_t klinechans = { NULL, NULL, 0 };
+static bool klinechans_loaded = false;
+
+static mowgli_node_t *
+klinechan_find(mychan_t *mc)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, klinechans.head)
+	{
+		if (n->data == mc)
+			return n;
+	}
+
+	return NULL;
+}
+
+static void
+klinechan_set(mychan_t *mc, bool enabled)
+{
+	mowgli_node_t *n = klinechan_find(mc);
+
+	if (enabled && n == NULL)
+		mowgli_node_add(mc, mowgli_node_create(), &klinechans);
+	else if (!enabled && n != NULL)
+	{
+		mowgli_node_delete(n, &klinechans);
+		mowgli_node_free(n);
+	}
+}
+
+static void
+klinechan_load(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	mychan_t *mc;
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	{
+		if (metadata_find(mc, "private:klinechan:closer"))
+			klinechan_set(mc, true);
+	}
+
+	klinechans_loaded = true;
+}
+
+/* a host waiting to be klined; the node is reused for its network's list at flush time */
+typedef struct {
+	mowgli_node_t node;
+	char *host;
+	char *chan;
+} klinechan_pending_t;
+
+static mowgli_patricia_t *pending_klines = NULL;
+static mowgli_eventloop_timer_t *flush_timer = NULL;
+
+/* this many queued hosts in one network are klined as the whole network (at least 2) */
+static unsigned int cidr_threshold = 8;
+static unsigned int cidr_ipv4 = 24;
+static unsigned int cidr_ipv6 = 64;
+
+static bool
+klinechan_network(const char *host, char *buf, size_t len)
+{
+	unsigned char addr[16];
+	unsigned int bits, size, i;
+	int af;
+
+	if (inet_pton(AF_INET, host, addr) == 1)
+	{
+		af = AF_INET;
+		size = 4;
+		bits = cidr_ipv4;
+	}
+	else if (inet_pton(AF_INET6, host, addr) == 1)
+	{
+		af = AF_INET6;
+		size = 16;
+		bits = cidr_ipv6;
+	}
+	else
+		return false;
+
+	for (i = 0; i < size; i++)
+	{
+		if (i * 8 >= bits)
+			addr[i] = 0;
+		else if ((i + 1) * 8 > bits)
+			addr[i] &= (unsigned char) (0xff << (8 - (bits - i * 8)));
+	}
+
+	if (inet_ntop(af, addr, buf, len) == NULL)
+		return false;
+
+	snprintf(buf + strlen(buf), len - strlen(buf), "/%u", bits);
+
+	return true;
+}
+
+static void
+klinechan_free_pending(klinechan_pending_t *p)
+{
+	sfree(p->host);
+	sfree(p->chan);
+	sfree(p);
+}
+
+/* the queued hosts inside one network */
+typedef struct {
+	char net[BUFSIZE];
+	mowgli_list_t hosts;
+	bool protected;
+} klinechan_network_t;
+
+/*
+ * A range kline would also hit everyone else connected from that range,
+ * so networks that contain exempt users or staff are klined host by host.
+ */
+static void
+klinechan_protect_networks(mowgli_patricia_t *networks)
+{
+	mowgli_patricia_iteration_state_t state;
+	klinechan_network_t *nw;
+	char net[BUFSIZE];
+	user_t *u;
+
+	MOWGLI_PATRICIA_FOREACH(u, &state, userlist)
+	{
+		if (u->ip == NULL || is_internal_client(u))
+			continue;
+
+		if (!klinechan_network(u->ip, net, sizeof net) || (nw = mowgli_patricia_retrieve(networks, net)) == NULL)
+			continue;
+
+		if (is_autokline_exempt(u) || has_priv_user(u, PRIV_JOIN_STAFFONLY))
+			nw->protected = true;
+	}
+}
+
+static void
+klinechan_flush(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	mowgli_patricia_t *networks;
+	klinechan_network_t *nw;
+	klinechan_pending_t *p;
+	mowgli_node_t *n, *tn;
+	char net[BUFSIZE], reason[256], chan[BUFSIZE];
+	unsigned int total = 0, klines = 0, ranges = 0;
+	bool many = false;
+
+	flush_timer = NULL;
+	chan[0] = '\0';
+
+	/* group the addresses by network, kline anything else right away */
+	networks = mowgli_patricia_create(NULL);
+
+	MOWGLI_PATRICIA_FOREACH(p, &state, pending_klines)
+	{
+		total++;
+
+		if (chan[0] == '\0')
+			mowgli_strlcpy(chan, p->chan, sizeof chan);
+		else if (irccasecmp(chan, p->chan))
+			many = true;
+
+		if (!klinechan_network(p->host, net, sizeof net))
+		{
+			snprintf(reason, sizeof reason, "Joining %s", p->chan);
+			kline_add("*", p->host, reason, config_options.kline_time, "*");
+			klines++;
+			klinechan_free_pending(p);
+			continue;
+		}
+
+		if ((nw = mowgli_patricia_retrieve(networks, net)) == NULL)
+		{
+			nw = scalloc(1, sizeof *nw);
+			mowgli_strlcpy(nw->net, net, sizeof nw->net);
+			mowgli_patricia_add(networks, net, nw);
+		}
+
+		mowgli_node_add(p, &p->node, &nw->hosts);
+	}
+
+	mowgli_patricia_destroy(pending_klines, NULL, NULL);
+	pending_klines = mowgli_patricia_create(NULL);
+
+	MOWGLI_PATRICIA_FOREACH(nw, &state, networks)
+	{
+		if (MOWGLI_LIST_LENGTH(&nw->hosts) >= cidr_threshold)
+		{
+			klinechan_protect_networks(networks);
+			break;
+		}
+	}
+
+	MOWGLI_PATRICIA_FOREACH(nw, &state, networks)
+	{
+		if (MOWGLI_LIST_LENGTH(&nw->hosts) >= cidr_threshold && !nw->protected)
+		{
+			p = nw->hosts.head->data;
+			snprintf(reason, sizeof reason, "Joining %s", p->chan);
+			slog(LG_INFO, "klinechan_flush(): klining \2*@%s\2 (%zu hosts joined klinechans)",
+					nw->net, MOWGLI_LIST_LENGTH(&nw->hosts));
+			kline_add("*", nw->net, reason, config_options.kline_time, "*");
+			klines++;
+			ranges++;
+		}
+		else
+		{
+			MOWGLI_ITER_FOREACH(n, nw->hosts.head)
+			{
+				p = n->data;
+				snprintf(reason, sizeof reason, "Joining %s", p->chan);
+				kline_add("*", p->host, reason, config_options.kline_time, "*");
+				klines++;
+			}
+		}
+
+		MOWGLI_ITER_FOREACH_SAFE(n, tn, nw->hosts.head)
+			klinechan_free_pending(n->data);
+
+		sfree(nw);
+	}
+
+	mowgli_patricia_destroy(networks, NULL, NULL);
+
+	if (total > 1)
+		wallops("Automatic klines for joins to \2%s\2%s: %u hosts klined with %u klines (%u network ranges).",
+				chan, many ? " and other channels" : "", total, klines, ranges);
+}
+
+static void
+klinechan_queue(const char *host, const char *chan)
+{
+	klinechan_pending_t *p;
+
+	if (mowgli_patricia_retrieve(pending_klines, host) != NULL)
+		return;
+
+	p = scalloc(1, sizeof *p);
+	p->host = sstrdup(host);
+	p->chan = sstrdup(chan);
+	mowgli_patricia_add(pending_klines, p->host, p);
+
+	if (flush_timer == NULL)
+		flush_timer = mowgli_timer_add_once(base_eventloop, "klinechan_flush", klinechan_flush, NULL, KLINECHAN_FLUSH_DELAY);
+}
+
+static void
+klinechan_drop(mychan_t *mc)
+{
+	klinechan_set(mc, false);
+}
+
 static void
 klinechan_check_join(hook_channel_joinpart_t *hdata)
 {
 	mychan_t *mc;
 	chanuser_t *cu = hdata->cu;
 	service_t *svs;
-	char reason[256];
 	const char *khost;
-	kline_t *k;
 
-	svs = service_find("operserv");
-	if (svs == NULL)
+	if (!klinechans_loaded)
+		klinechan_load();
+
+	if (MOWGLI_LIST_LENGTH(&klinechans) == 0)
 		return;
 
 	if (cu == NULL || is_internal_client(cu->user))
 		return;
 
-	if (!(mc = mychan_from(cu->chan)))
+	if (!(mc = mychan_from(cu->chan)) || klinechan_find(mc) == NULL)
 		return;
 
 	/* If they've already been sent a kline, do nothing */
 	if (cu->user->flags & UF_KLINESENT)
 		return;
 
+	svs = service_find("operserv");
+	if (svs == NULL)
+		return;
+
 	if (metadata_find(mc, "private:klinechan:closer"))
 	{
 		khost = cu->user->ip ? cu->user->ip : cu->user->host;
@@ -50,14 +320,12 @@ klinechan_check_join(hook_channel_joinpart_t *hdata)
 		}
 		else
 		{
-			snprintf(reason, sizeof reason, "Joining %s",
-					cu->chan->name);
 			slog(LG_INFO, "klinechan_check_join(): klining \2*@%s\2 (user \2%s!%s@%s\2 joined \2%s\2)",
 					khost, cu->user->nick,
 					cu->user->user, cu->user->host,
 					cu->chan->name);
 
-			k = kline_add("*", khost, reason, config_options.kline_time, "*");
+			klinechan_queue(khost, cu->chan->name);
 			cu->user->flags |= UF_KLINESENT;
 		}
 	}
@@ -134,6 +402,7 @@ os_cmd_klinechan(sourceinfo_t *si, int parc, char *parv[])
 		metadata_add(mc, "private:klinechan:closer", si->su->nick);
 		metadata_add(mc, "private:klinechan:reason", reason);
 		metadata_add(mc, "private:klinechan:timestamp", number_to_string(CURRTIME));
+		klinechan_set(mc, true);
 
 		wallops("%s enabled automatic klines on the channel \2%s\2 (%s).", get_oper_name(si), target, reason);
 		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:ON: \2%s\2 (reason: \2%s\2)", target, reason);
@@ -150,6 +419,7 @@ os_cmd_klinechan(sourceinfo_t *si, int parc, char *parv[])
 		metadata_delete(mc, "private:klinechan:closer");
 		metadata_delete(mc, "private:klinechan:reason");
 		metadata_delete(mc, "private:klinechan:timestamp");
+		klinechan_set(mc, false);
 
 		wallops("%s disabled automatic klines on the channel \2%s\2.", get_oper_name(si), target);
 		logcommand(si, CMDLOG_ADMIN, "KLINECHAN:OFF: \2%s\2", target);
@@ -223,16 +493,47 @@ mod_init(module_t *const restrict m)
 
 	hook_add_event("channel_info");
 	hook_add_channel_info(klinechan_show_info);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(klinechan_drop);
+
+	pending_klines = mowgli_patricia_create(NULL);
+
+	add_uint_conf_item("klinechan_cidr_threshold", &conf_gi_table, 0, &cidr_threshold, 2, INT_MAX, 8);
+	add_uint_conf_item("klinechan_cidr_ipv4", &conf_gi_table, 0, &cidr_ipv4, 8, 32, 24);
+	add_uint_conf_item("klinechan_cidr_ipv6", &conf_gi_table, 0, &cidr_ipv6, 16, 128, 64);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	service_named_unbind_command("operserv", &os_klinechan);
 	service_named_unbind_command("operserv", &os_listklinechans);
 
 	hook_del_channel_join(klinechan_check_join);
 	hook_del_channel_info(klinechan_show_info);
+	hook_del_channel_drop(klinechan_drop);
+
+	del_conf_item("klinechan_cidr_threshold", &conf_gi_table);
+	del_conf_item("klinechan_cidr_ipv4", &conf_gi_table);
+	del_conf_item("klinechan_cidr_ipv6", &conf_gi_table);
+
+	/* whatever is still queued is sent now rather than lost */
+	if (flush_timer != NULL)
+	{
+		mowgli_timer_destroy(base_eventloop, flush_timer);
+		klinechan_flush(NULL);
+	}
+
+	mowgli_patricia_destroy(pending_klines, NULL, NULL);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, klinechans.head)
+	{
+		mowgli_node_delete(n, &klinechans);
+		mowgli_node_free(n);
+	}
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_klinechan", MODULE_UNLOAD_CAPABILITY_OK)
@@ -9,15 +9,98 @@
 
 #if (CURRENT_ABI_REVISION >= 730000)
 
+#include <arpa/inet.h>
+
 struct blacklist_entry
 {
 	mowgli_node_t   node;
 	char *          data;
+	unsigned int    denials;
+	time_t          last_denial;
+};
+
+/* One counter of the space-saving sketch behind the hot list. A host
+ * that evicted another one inherits its count, recorded as the error.
+ */
+struct blacklist_hotlist_slot
+{
+	char            host[COMPAT_HOSTLEN + 1];
+	unsigned int    count;
+	unsigned int    error;
+};
+
+/* One bit of an address per level; a node with an entry terminates a CIDR
+ * that covers every address below it.
+ */
+struct blacklist_trie_node
+{
+	struct blacklist_trie_node *    child[2];
+	struct blacklist_entry *        entry;
+};
+
+/* restricted_hosts, split up when the configuration is loaded: literal
+ * hostnames go into a case-insensitive dictionary, IP addresses and CIDR
+ * masks into one binary trie per address family, and only the entries
+ * that really are wildcard masks are left to match() one by one.
+ */
+struct blacklist_index
+{
+	mowgli_patricia_t *             exact;
+	struct blacklist_trie_node *    ipv4;
+	struct blacklist_trie_node *    ipv6;
+	mowgli_list_t                   globs;
+};
+
+/* The outcome of find_restricted_user(), cached on the user. It is only
+ * valid while its generation matches restricted_generation, which is
+ * bumped whenever restricted_hosts is reloaded; a host change resets it.
+ */
+struct blacklist_verdict
+{
+	unsigned int                    generation;
+	struct blacklist_entry *        entry;
+};
+
+/* Mechanisms that Atheme itself provides, used to catch typos in
+ * permitted_mechanisms. Third-party mechanisms are still allowed.
+ */
+static const char *const blacklist_known_mechanisms[] = {
+	"ANONYMOUS", "AUTHCOOKIE", "ECDH-X25519-CHALLENGE", "ECDSA-NIST256P-CHALLENGE", "EXTERNAL", "PLAIN",
+	"SCRAM-SHA-1", "SCRAM-SHA-256", "SCRAM-SHA-512", NULL,
 };
 
+/* Every mechanism seen during authentication gets a slot; bit N of
+ * permitted_mech_bits says whether the mechanism in slot N is permitted.
+ * Both are reset whenever permitted_mechanisms is reloaded. Slots hold
+ * the mechanism's name rather than a pointer to it, because mechanism
+ * modules can be unloaded and loaded again at a different address.
+ */
+#define BLACKLIST_MECH_SLOTS            32U
+
+// RFC 4422 limits mechanism names to 20 characters
+#define BLACKLIST_MECH_NAMELEN          20U
+
+// Number of denied hosts tracked, and shown by default, in the hot list
+#define BLACKLIST_HOTLIST_SIZE          64U
+#define BLACKLIST_HOTLIST_SHOW          10U
+
+#define BLACKLIST_VERDICT_PRIVDATA      "sasl_blacklist:verdict"
+
 static mowgli_list_t restricted_hosts;
 static mowgli_list_t permitted_mechanisms;
 
+static struct blacklist_index restricted_index;
+static mowgli_heap_t *blacklist_trie_heap = NULL;
+static mowgli_heap_t *blacklist_verdict_heap = NULL;
+static unsigned int restricted_generation = 1;
+
+static char mech_slots[BLACKLIST_MECH_SLOTS][BLACKLIST_MECH_NAMELEN + 1];
+static unsigned int mech_slot_count = 0;
+static uint32_t permitted_mech_bits = 0;
+
+static struct blacklist_hotlist_slot hotlist[BLACKLIST_HOTLIST_SIZE];
+static unsigned int hotlist_used = 0;
+
 static struct service *saslsvs = NULL;
 static struct service *opersvs = NULL;
 
@@ -51,7 +134,7 @@ blacklist_process_configentry(mowgli_config_file_entry_t *const restrict ce, mow
 	{
 		if (! subce->entries)
 		{
-			struct blacklist_entry *const entry = smalloc(sizeof *entry);
+			struct blacklist_entry *const entry = scalloc(1, sizeof *entry);
 
 			entry->data = sstrdup(subce->varname);
 
@@ -62,11 +145,208 @@ blacklist_process_configentry(mowgli_config_file_entry_t *const restrict ce, mow
 	}
 }
 
+static void
+blacklist_trie_free(struct blacklist_trie_node *const restrict node)
+{
+	if (! node)
+		return;
+
+	(void) blacklist_trie_free(node->child[0]);
+	(void) blacklist_trie_free(node->child[1]);
+	(void) mowgli_heap_free(blacklist_trie_heap, node);
+}
+
+static void
+blacklist_trie_add(struct blacklist_trie_node **const restrict root, const unsigned char *const restrict addr,
+                   const unsigned int prefixlen, struct blacklist_entry *const restrict entry)
+{
+	struct blacklist_trie_node **np = root;
+
+	for (unsigned int i = 0; ; i++)
+	{
+		if (! *np)
+		{
+			*np = mowgli_heap_alloc(blacklist_trie_heap);
+			(void) memset(*np, 0x00, sizeof **np);
+		}
+
+		if (i == prefixlen)
+			break;
+
+		np = &(*np)->child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+	}
+
+	// A shorter mask covering this one wins, and so does the first of two duplicates
+	if (! (*np)->entry)
+		(*np)->entry = entry;
+}
+
+static struct blacklist_entry *
+blacklist_trie_find(const struct blacklist_trie_node *node, const unsigned char *const restrict addr,
+                    const unsigned int addrlen)
+{
+	for (unsigned int i = 0; node != NULL; i++)
+	{
+		if (node->entry)
+			return node->entry;
+
+		if (i == addrlen)
+			break;
+
+		node = node->child[(addr[i / 8] >> (7 - (i % 8))) & 1];
+	}
+
+	return NULL;
+}
+
+/* Parses an IPv4 or IPv6 address with an optional /prefix. Returns the
+ * address family, or 0 if the string is not an address or CIDR mask.
+ */
+static int
+blacklist_parse_cidr(const char *const restrict str, unsigned char *const restrict addr,
+                     unsigned int *const restrict prefixlen)
+{
+	char buf[INET6_ADDRSTRLEN + 5];
+	const char *const slash = strchr(str, '/');
+	unsigned int maxlen;
+	int af;
+
+	if (mowgli_strlcpy(buf, str, sizeof buf) >= sizeof buf)
+		return 0;
+
+	if (slash)
+		buf[slash - str] = '\0';
+
+	if (inet_pton(AF_INET, buf, addr) == 1)
+	{
+		af = AF_INET;
+		maxlen = 32;
+	}
+	else if (inet_pton(AF_INET6, buf, addr) == 1)
+	{
+		af = AF_INET6;
+		maxlen = 128;
+	}
+	else
+		return 0;
+
+	*prefixlen = maxlen;
+
+	if (slash)
+	{
+		char *end = NULL;
+		const unsigned long len = strtoul(slash + 1, &end, 10);
+
+		if (! slash[1] || *end || len > maxlen)
+			return 0;
+
+		*prefixlen = (unsigned int) len;
+	}
+
+	return af;
+}
+
+static void
+blacklist_index_clear(struct blacklist_index *const restrict idx)
+{
+	mowgli_node_t *n, *tn;
+
+	if (idx->exact)
+		(void) mowgli_patricia_destroy(idx->exact, NULL, NULL);
+
+	(void) blacklist_trie_free(idx->ipv4);
+	(void) blacklist_trie_free(idx->ipv6);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, idx->globs.head)
+	{
+		(void) mowgli_node_delete(n, &idx->globs);
+		(void) mowgli_node_free(n);
+	}
+
+	idx->exact = NULL;
+	idx->ipv4 = NULL;
+	idx->ipv6 = NULL;
+}
+
+static void
+blacklist_index_build(struct blacklist_index *const restrict idx, const mowgli_list_t *const restrict list)
+{
+	mowgli_node_t *n;
+
+	(void) blacklist_index_clear(idx);
+
+	idx->exact = mowgli_patricia_create(&irccasecanon);
+
+	MOWGLI_ITER_FOREACH(n, list->head)
+	{
+		struct blacklist_entry *const entry = n->data;
+		unsigned char addr[16];
+		unsigned int prefixlen;
+
+		switch (blacklist_parse_cidr(entry->data, addr, &prefixlen))
+		{
+			case AF_INET:
+				(void) blacklist_trie_add(&idx->ipv4, addr, prefixlen, entry);
+				continue;
+
+			case AF_INET6:
+				(void) blacklist_trie_add(&idx->ipv6, addr, prefixlen, entry);
+				continue;
+		}
+
+		if (strpbrk(entry->data, "*?\\"))
+			(void) mowgli_node_add(entry, mowgli_node_create(), &idx->globs);
+		else if (! mowgli_patricia_retrieve(idx->exact, entry->data))
+			(void) mowgli_patricia_add(idx->exact, entry->data, entry);
+	}
+}
+
+static void
+blacklist_free_saved_counter(const char ATHEME_VATTR_UNUSED *const restrict key, void *const restrict entry,
+                             void ATHEME_VATTR_UNUSED *const restrict privdata)
+{
+	(void) sfree(entry);
+}
+
 static int
 c_restricted_hosts(mowgli_config_file_entry_t *const restrict ce)
 {
+	mowgli_patricia_t *const counters = mowgli_patricia_create(NULL);
+	mowgli_node_t *n;
+
+	// Carry the denial counters of rules that survive a rehash over
+	MOWGLI_ITER_FOREACH(n, restricted_hosts.head)
+	{
+		struct blacklist_entry *const entry = n->data;
+		struct blacklist_entry *const saved = smalloc(sizeof *saved);
+
+		*saved = *entry;
+
+		if (! mowgli_patricia_add(counters, entry->data, saved))
+			(void) sfree(saved);
+	}
+
 	(void) blacklist_process_configentry(ce, &restricted_hosts, "restricted_hosts");
 
+	MOWGLI_ITER_FOREACH(n, restricted_hosts.head)
+	{
+		struct blacklist_entry *const entry = n->data;
+		const struct blacklist_entry *const saved = mowgli_patricia_retrieve(counters, entry->data);
+
+		if (! saved)
+			continue;
+
+		entry->denials = saved->denials;
+		entry->last_denial = saved->last_denial;
+	}
+
+	(void) mowgli_patricia_destroy(counters, &blacklist_free_saved_counter, NULL);
+	(void) blacklist_index_build(&restricted_index, &restricted_hosts);
+
+	// Cached verdicts may point at entries that were just freed
+	if (! ++restricted_generation)
+		restricted_generation = 1;
+
 	return 0;
 }
 
@@ -75,49 +355,149 @@ c_permitted_mechanisms(mowgli_config_file_entry_t *const restrict ce)
 {
 	(void) blacklist_process_configentry(ce, &permitted_mechanisms, "permitted_mechanisms");
 
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, permitted_mechanisms.head)
+	{
+		const struct blacklist_entry *const entry = n->data;
+		size_t i;
+
+		for (i = 0; blacklist_known_mechanisms[i]; i++)
+			if (strcmp(blacklist_known_mechanisms[i], entry->data) == 0)
+				break;
+
+		if (! blacklist_known_mechanisms[i])
+			(void) conf_report_warning(ce, "saslserv::permitted_mechanisms entry '%s' is not a "
+			                               "mechanism provided by Atheme (typo?)", entry->data);
+	}
+
+	mech_slot_count = 0;
+	permitted_mech_bits = 0;
+
 	return 0;
 }
 
-static bool
-is_restricted_host(const char *const restrict host)
+static struct blacklist_entry *
+find_restricted_host(const char *const restrict host)
 {
 	if (! host || ! *host)
-		return false;
+		return NULL;
+
+	struct blacklist_entry *entry;
+	unsigned char addr[16];
+
+	if (inet_pton(AF_INET, host, addr) == 1)
+	{
+		if ((entry = blacklist_trie_find(restricted_index.ipv4, addr, 32)))
+			return entry;
+	}
+	else if (inet_pton(AF_INET6, host, addr) == 1)
+	{
+		if ((entry = blacklist_trie_find(restricted_index.ipv6, addr, 128)))
+			return entry;
+	}
+
+	if (restricted_index.exact && (entry = mowgli_patricia_retrieve(restricted_index.exact, host)))
+		return entry;
 
 	mowgli_node_t *n;
 
-	MOWGLI_ITER_FOREACH(n, restricted_hosts.head)
+	MOWGLI_ITER_FOREACH(n, restricted_index.globs.head)
 	{
-		struct blacklist_entry *const entry = n->data;
+		entry = n->data;
 
-		if (match(entry->data, host) == 0 || match_ips(entry->data, host) == 0)
-			return true;
+		if (match(entry->data, host) == 0)
+			return entry;
 	}
 
-	return false;
+	return NULL;
 }
 
-static bool
-is_restricted_session(const struct sasl_session *const restrict sess)
+/* Looks up each distinct string in hosts[] once; a user's host, cloaked
+ * host, vhost and IP address are frequently one and the same.
+ */
+static struct blacklist_entry *
+find_restricted_hosts(const char *const hosts[], const size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		bool seen = false;
+
+		if (! hosts[i] || ! *hosts[i])
+			continue;
+
+		for (size_t j = 0; j < i && ! seen; j++)
+			seen = (hosts[j] && (hosts[j] == hosts[i] || strcmp(hosts[j], hosts[i]) == 0));
+
+		if (seen)
+			continue;
+
+		struct blacklist_entry *const entry = find_restricted_host(hosts[i]);
+
+		if (entry)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct blacklist_entry *
+find_restricted_session(const struct sasl_session *const restrict sess)
 {
 	if (! sess)
-		return false;
+		return NULL;
 
-	return is_restricted_host(sess->host) || is_restricted_host(sess->ip);
+	const char *const hosts[] = { sess->host, sess->ip };
+
+	return find_restricted_hosts(hosts, sizeof hosts / sizeof hosts[0]);
 }
 
-static bool
-is_restricted_user(const struct user *const restrict u)
+static struct blacklist_entry *
+find_restricted_user(const struct user *const restrict u)
 {
 	if (! u)
-		return false;
+		return NULL;
+
+	struct user *const target = (struct user *) u;
+	struct blacklist_verdict *verdict = privatedata_get(target, BLACKLIST_VERDICT_PRIVDATA);
+
+	if (verdict && verdict->generation == restricted_generation)
+		return verdict->entry;
+
+	const char *const hosts[] = { u->host, u->chost, u->vhost, u->ip };
+
+	if (! verdict)
+	{
+		verdict = mowgli_heap_alloc(blacklist_verdict_heap);
+		(void) privatedata_set(target, BLACKLIST_VERDICT_PRIVDATA, verdict);
+	}
+
+	verdict->generation = restricted_generation;
+	verdict->entry = find_restricted_hosts(hosts, sizeof hosts / sizeof hosts[0]);
+
+	return verdict->entry;
+}
+
+static void
+blacklist_user_sethost(struct user *const restrict u)
+{
+	struct blacklist_verdict *const verdict = privatedata_get(u, BLACKLIST_VERDICT_PRIVDATA);
+
+	if (verdict)
+		verdict->generation = 0;
+}
 
-	return is_restricted_host(u->host) || is_restricted_host(u->chost) ||
-	       is_restricted_host(u->vhost) || is_restricted_host(u->ip);
+static void
+blacklist_user_delete(struct user *const restrict u)
+{
+	struct blacklist_verdict *const verdict = privatedata_delete(u, BLACKLIST_VERDICT_PRIVDATA);
+
+	if (verdict)
+		(void) mowgli_heap_free(blacklist_verdict_heap, verdict);
 }
 
 static bool
-is_permitted_mechanism(const char *const restrict mech)
+is_permitted_mechanism_name(const char *const restrict mech)
 {
 	if (! mech || ! *mech)
 		return false;
@@ -135,6 +515,72 @@ is_permitted_mechanism(const char *const restrict mech)
 	return false;
 }
 
+static bool
+is_permitted_mechanism(const struct sasl_mechanism *const restrict mech)
+{
+	for (unsigned int i = 0; i < mech_slot_count; i++)
+		if (strcmp(mech_slots[i], mech->name) == 0)
+			return (permitted_mech_bits >> i) & 1U;
+
+	// First time this mechanism is seen since the list was (re)loaded
+	const bool permitted = is_permitted_mechanism_name(mech->name);
+
+	if (mech_slot_count < BLACKLIST_MECH_SLOTS && strlen(mech->name) <= BLACKLIST_MECH_NAMELEN)
+	{
+		if (permitted)
+			permitted_mech_bits |= (1U << mech_slot_count);
+
+		(void) mowgli_strlcpy(mech_slots[mech_slot_count++], mech->name, sizeof mech_slots[0]);
+	}
+
+	return permitted;
+}
+
+static void
+blacklist_hotlist_add(const char *const restrict host)
+{
+	struct blacklist_hotlist_slot *slot = NULL;
+
+	if (! host || ! *host)
+		return;
+
+	for (unsigned int i = 0; i < hotlist_used; i++)
+	{
+		if (strcmp(hotlist[i].host, host) == 0)
+		{
+			hotlist[i].count++;
+			return;
+		}
+
+		if (! slot || hotlist[i].count < slot->count)
+			slot = &hotlist[i];
+	}
+
+	if (hotlist_used < BLACKLIST_HOTLIST_SIZE)
+	{
+		slot = &hotlist[hotlist_used++];
+		slot->count = 0;
+		slot->error = 0;
+	}
+	else
+		// Evict the least-denied host; the newcomer may have been it all along
+		slot->error = slot->count;
+
+	(void) mowgli_strlcpy(slot->host, host, sizeof slot->host);
+
+	slot->count++;
+}
+
+static void
+blacklist_record_denial(struct blacklist_entry *const restrict entry, const char *const restrict ip,
+                        const char *const restrict host)
+{
+	entry->denials++;
+	entry->last_denial = CURRTIME;
+
+	(void) blacklist_hotlist_add((ip && *ip) ? ip : host);
+}
+
 static void ATHEME_FATTR_PRINTF(2, 3)
 log_user(const struct user *const restrict u, const char *const restrict fmt, ...)
 {
@@ -172,25 +618,36 @@ blacklist_can_login(hook_user_login_check_t *const restrict c)
 		if (ssi->sess && ! ssi->sess->mechptr)
 			return;
 
-		if (is_restricted_session(ssi->sess))
+		struct blacklist_entry *const entry = find_restricted_session(ssi->sess);
+
+		if (entry)
 		{
 			const char *const log_target = service_get_log_target(saslsvs);
 
-			if (! is_permitted_mechanism(ssi->sess->mechptr->name))
+			if (! is_permitted_mechanism(ssi->sess->mechptr))
 			{
 				(void) slog(LG_VERBOSE, "%s %s:%s denied login to \2%s\2 ('%s' not allowed)",
 				            log_target, entity(c->mu)->name, ssi->sess->uid, entity(c->mu)->name,
 				            ssi->sess->mechptr->name);
 
+				(void) blacklist_record_denial(entry, ssi->sess->ip, ssi->sess->host);
+
 				c->allowed = false;
 			}
 		}
 	}
-	else if (is_restricted_user(c->si->su))
+	else
 	{
+		struct blacklist_entry *const entry = find_restricted_user(c->si->su);
+
+		if (! entry)
+			return;
+
 		(void) log_user(c->si->su, "denied login to \2%s\2 (restricted address)",
 		                entity(c->mu)->name);
 
+		(void) blacklist_record_denial(entry, c->si->su->ip, c->si->su->host);
+
 		c->allowed = false;
 	}
 }
@@ -198,11 +655,15 @@ blacklist_can_login(hook_user_login_check_t *const restrict c)
 static void
 blacklist_can_register(hook_user_register_check_t *const restrict c)
 {
-	if (is_restricted_user(c->si->su))
+	struct blacklist_entry *const entry = find_restricted_user(c->si->su);
+
+	if (entry)
 	{
 		(void) log_user(c->si->su, "denied registration of \2%s\2 (restricted address)",
 		                c->account);
 
+		(void) blacklist_record_denial(entry, c->si->su->ip, c->si->su->host);
+
 		c->approved++;
 	}
 }
@@ -210,11 +671,15 @@ blacklist_can_register(hook_user_register_check_t *const restrict c)
 static void
 blacklist_can_rename(hook_user_rename_check_t *const restrict c)
 {
-	if (is_restricted_user(c->si->su))
+	struct blacklist_entry *const entry = find_restricted_user(c->si->su);
+
+	if (entry)
 	{
 		(void) log_user(c->si->su, "denied account name change from \2%s\2 to \2%s\2 (restricted address)",
 		                entity(c->mu)->name, c->mn->nick);
 
+		(void) blacklist_record_denial(entry, c->si->su->ip, c->si->su->host);
+
 		c->allowed = false;
 	}
 }
@@ -222,14 +687,144 @@ blacklist_can_rename(hook_user_rename_check_t *const restrict c)
 static void
 blacklist_can_logout(hook_user_logout_check_t *const restrict c)
 {
-	if (is_restricted_user(c->u))
+	struct blacklist_entry *const entry = find_restricted_user(c->u);
+
+	if (entry)
 	{
 		(void) log_user(c->u, "denied logout (restricted address)");
 
+		(void) blacklist_record_denial(entry, c->u->ip, c->u->host);
+
 		c->allowed = false;
 	}
 }
 
+static int
+blacklist_entry_cmp(const void *const restrict a, const void *const restrict b)
+{
+	const struct blacklist_entry *const ea = *((const struct blacklist_entry *const *) a);
+	const struct blacklist_entry *const eb = *((const struct blacklist_entry *const *) b);
+
+	return (ea->denials < eb->denials) - (ea->denials > eb->denials);
+}
+
+static int
+blacklist_hotlist_cmp(const void *const restrict a, const void *const restrict b)
+{
+	const struct blacklist_hotlist_slot *const sa = a;
+	const struct blacklist_hotlist_slot *const sb = b;
+
+	return (sa->count < sb->count) - (sa->count > sb->count);
+}
+
+static void
+os_cmd_saslrestrict_rules(struct sourceinfo *const restrict si)
+{
+	const size_t count = MOWGLI_LIST_LENGTH(&restricted_hosts);
+	struct blacklist_entry **const entries = smalloc(sizeof *entries * (count + 1));
+	mowgli_node_t *n;
+	size_t matches = 0;
+
+	MOWGLI_ITER_FOREACH(n, restricted_hosts.head)
+	{
+		struct blacklist_entry *const entry = n->data;
+
+		if (entry->denials)
+			entries[matches++] = entry;
+	}
+
+	(void) qsort(entries, matches, sizeof *entries, &blacklist_entry_cmp);
+
+	for (size_t i = 0; i < matches; i++)
+		(void) command_success_nodata(si, _("%zu: \2%s\2 - %u denials (last %s ago)"), i + 1,
+		                              entries[i]->data, entries[i]->denials, time_ago(entries[i]->last_denial));
+
+	(void) command_success_nodata(si, _("\2%zu\2 of \2%zu\2 restricted hosts have denied requests."),
+	                              matches, count);
+	(void) sfree(entries);
+}
+
+static void
+os_cmd_saslrestrict_hosts(struct sourceinfo *const restrict si, const char *const restrict arg)
+{
+	struct blacklist_hotlist_slot sorted[BLACKLIST_HOTLIST_SIZE];
+	const int requested = arg ? atoi(arg) : (int) BLACKLIST_HOTLIST_SHOW;
+
+	if (requested <= 0)
+	{
+		(void) command_fail(si, fault_badparams, STR_INVALID_PARAMS, "SASLRESTRICT HOSTS");
+		return;
+	}
+
+	(void) memcpy(sorted, hotlist, sizeof hotlist[0] * hotlist_used);
+	(void) qsort(sorted, hotlist_used, sizeof sorted[0], &blacklist_hotlist_cmp);
+
+	unsigned int show = (unsigned int) requested;
+
+	if (show > hotlist_used)
+		show = hotlist_used;
+
+	for (unsigned int i = 0; i < show; i++)
+		(void) command_success_nodata(si, _("%u: \2%s\2 - %u denials (overestimated by at most %u)"),
+		                              i + 1, sorted[i].host, sorted[i].count, sorted[i].error);
+
+	(void) command_success_nodata(si, _("End of hot list (%u of %u tracked hosts shown)."), show, hotlist_used);
+}
+
+static void
+os_cmd_saslrestrict(struct sourceinfo *const restrict si, const int ATHEME_VATTR_UNUSED parc, char **const restrict parv)
+{
+	const char *const subcmd = parv[0];
+
+	if (! subcmd || strcasecmp(subcmd, "HOSTS") == 0)
+	{
+		(void) os_cmd_saslrestrict_hosts(si, subcmd ? parv[1] : NULL);
+		(void) logcommand(si, CMDLOG_GET, "SASLRESTRICT:HOSTS");
+	}
+	else if (strcasecmp(subcmd, "RULES") == 0)
+	{
+		(void) os_cmd_saslrestrict_rules(si);
+		(void) logcommand(si, CMDLOG_GET, "SASLRESTRICT:RULES");
+	}
+	else if (strcasecmp(subcmd, "RESET") == 0)
+	{
+		mowgli_node_t *n;
+
+		if (! has_priv(si, PRIV_ADMIN))
+		{
+			(void) command_fail(si, fault_noprivs, STR_NO_PRIVILEGE, PRIV_ADMIN);
+			return;
+		}
+
+		MOWGLI_ITER_FOREACH(n, restricted_hosts.head)
+		{
+			struct blacklist_entry *const entry = n->data;
+
+			entry->denials = 0;
+			entry->last_denial = 0;
+		}
+
+		hotlist_used = 0;
+
+		(void) command_success_nodata(si, _("SASL restriction counters have been reset."));
+		(void) logcommand(si, CMDLOG_ADMIN, "SASLRESTRICT:RESET");
+	}
+	else
+	{
+		(void) command_fail(si, fault_badparams, STR_INVALID_PARAMS, "SASLRESTRICT");
+		(void) command_fail(si, fault_badparams, _("Syntax: SASLRESTRICT [HOSTS [count]|RULES|RESET]"));
+	}
+}
+
+static struct command os_saslrestrict = {
+	.name           = "SASLRESTRICT",
+	.desc           = N_("Shows which restricted hosts are being denied most."),
+	.access         = PRIV_SERVER_AUSPEX,
+	.maxparc        = 2,
+	.cmd            = &os_cmd_saslrestrict,
+	.help           = { .path = "contrib/saslrestrict" },
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
@@ -253,6 +848,15 @@ mod_init(module_t *const restrict m)
 		return;
 	}
 
+	if (! (blacklist_trie_heap = mowgli_heap_create(sizeof(struct blacklist_trie_node), 256, BH_NOW)) ||
+	    ! (blacklist_verdict_heap = mowgli_heap_create(sizeof(struct blacklist_verdict), 1024, BH_NOW)))
+	{
+		(void) slog(LG_ERROR, "%s: mowgli_heap_create() failed", m->name);
+
+		m->mflags |= MODFLAG_FAIL;
+		return;
+	}
+
 	(void) hook_add_event("user_can_login");
 	(void) hook_add_user_can_login(&blacklist_can_login);
 
@@ -265,8 +869,16 @@ mod_init(module_t *const restrict m)
 	(void) hook_add_event("user_can_rename");
 	(void) hook_add_user_can_rename(&blacklist_can_rename);
 
+	(void) hook_add_event("user_sethost");
+	(void) hook_add_user_sethost(&blacklist_user_sethost);
+
+	(void) hook_add_event("user_delete");
+	(void) hook_add_user_delete(&blacklist_user_delete);
+
 	(void) add_conf_item("RESTRICTED_HOSTS", &saslsvs->conf_table, &c_restricted_hosts);
 	(void) add_conf_item("PERMITTED_MECHANISMS", &saslsvs->conf_table, &c_permitted_mechanisms);
+
+	(void) service_bind_command(opersvs, &os_saslrestrict);
 }
 
 static void
@@ -275,13 +887,27 @@ mod_deinit(const module_unload_intent_t ATHEME_VATTR_UNUSED intent)
 	(void) del_conf_item("RESTRICTED_HOSTS", &saslsvs->conf_table);
 	(void) del_conf_item("PERMITTED_MECHANISMS", &saslsvs->conf_table);
 
+	(void) service_unbind_command(opersvs, &os_saslrestrict);
+
 	(void) hook_del_user_can_login(&blacklist_can_login);
 	(void) hook_del_user_can_register(&blacklist_can_register);
 	(void) hook_del_user_can_logout(&blacklist_can_logout);
 	(void) hook_del_user_can_rename(&blacklist_can_rename);
+	(void) hook_del_user_sethost(&blacklist_user_sethost);
+	(void) hook_del_user_delete(&blacklist_user_delete);
+
+	struct user *u;
+	mowgli_patricia_iteration_state_t state;
 
+	MOWGLI_PATRICIA_FOREACH(u, &state, userlist)
+		(void) blacklist_user_delete(u);
+
+	(void) blacklist_index_clear(&restricted_index);
 	(void) blacklist_clear_list(&restricted_hosts);
 	(void) blacklist_clear_list(&permitted_mechanisms);
+
+	(void) mowgli_heap_destroy(blacklist_trie_heap);
+	(void) mowgli_heap_destroy(blacklist_verdict_heap);
 }
 
 #else /* (CURRENT_ABI_REVISION >= 730000) */
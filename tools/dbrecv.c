@@ -0,0 +1,288 @@
+/*
+ * SPDX-License-Identifier: ISC
+ * SPDX-URL: https://spdx.org/licenses/ISC.html
+ *
+ * Copyright (C) 2021 Atheme Development Group (https://atheme.github.io/)
+ *
+ * atheme-dbrecv: applies a replication stream from contrib/on_db_save to
+ * a standby copy of the services database.
+ *
+ *   atheme-dbrecv /srv/atheme/services.db < stream
+ *
+ * The new copy is written next to the old one and only renamed over it
+ * once its length and digest match what the stream announced. See
+ * src/on_db_save.c for the stream format; the chunking and hashing here
+ * must stay identical to the module's.
+ *
+ * Exit status: 0 on success, 1 on a usage or I/O error, 2 if the local
+ * copy is not the one the stream was computed against (the module will
+ * send a full copy next time), 3 if the stream is malformed.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REPLICA_FNV_OFFSET	UINT64_C(14695981039346656037)
+#define REPLICA_FNV_PRIME	UINT64_C(1099511628211)
+#define REPLICA_CHUNK_MASK	0x1f
+#define REPLICA_CHUNK_MAX	(64 * 1024)
+
+#define EXIT_IO			1
+#define EXIT_BASE		2
+#define EXIT_STREAM		3
+
+struct chunk {
+	uint64_t hash;
+	size_t off, len;
+};
+
+static const char *progname = "atheme-dbrecv";
+
+static uint64_t
+replica_hash(const char *data, size_t len, uint64_t hash)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= REPLICA_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static size_t
+replica_next_chunk(const char *data, size_t len)
+{
+	const char *nl;
+	size_t off = 0, end;
+
+	while (off < len)
+	{
+		nl = memchr(data + off, '\n', len - off);
+		end = nl != NULL ? (size_t) (nl - data) + 1 : len;
+
+		if ((replica_hash(data + off, end - off, REPLICA_FNV_OFFSET) & REPLICA_CHUNK_MASK) == 0 || end >= REPLICA_CHUNK_MAX)
+			return end;
+
+		off = end;
+	}
+
+	return off;
+}
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+
+	if (ret == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", progname);
+		exit(EXIT_IO);
+	}
+
+	return ret;
+}
+
+/* reads the current copy; a missing file reads as empty */
+static char *
+read_file(const char *path, size_t *lenp)
+{
+	char *data = NULL;
+	size_t len = 0, size = 0, n;
+	FILE *f;
+
+	*lenp = 0;
+
+	if ((f = fopen(path, "rb")) == NULL)
+	{
+		if (errno == ENOENT)
+			return NULL;
+
+		fprintf(stderr, "%s: cannot open %s: %s\n", progname, path, strerror(errno));
+		exit(EXIT_IO);
+	}
+
+	do
+	{
+		if (len == size)
+		{
+			size = size ? size * 2 : 1048576;
+			data = xrealloc(data, size);
+		}
+
+		n = fread(data + len, 1, size - len, f);
+		len += n;
+	} while (n != 0);
+
+	if (ferror(f))
+	{
+		fprintf(stderr, "%s: cannot read %s: %s\n", progname, path, strerror(errno));
+		exit(EXIT_IO);
+	}
+
+	fclose(f);
+	*lenp = len;
+
+	return data;
+}
+
+static int
+chunk_cmp(const void *a, const void *b)
+{
+	const struct chunk *ca = a, *cb = b;
+
+	return (ca->hash > cb->hash) - (ca->hash < cb->hash);
+}
+
+static struct chunk *
+index_chunks(const char *data, size_t len, size_t *countp)
+{
+	struct chunk *chunks = NULL;
+	size_t count = 0, size = 0, off, n;
+
+	for (off = 0; off < len; off += n)
+	{
+		n = replica_next_chunk(data + off, len - off);
+
+		if (count == size)
+		{
+			size = size ? size * 2 : 1024;
+			chunks = xrealloc(chunks, size * sizeof *chunks);
+		}
+
+		chunks[count].hash = replica_hash(data + off, n, REPLICA_FNV_OFFSET);
+		chunks[count].off = off;
+		chunks[count].len = n;
+		count++;
+	}
+
+	if (count != 0)
+		qsort(chunks, count, sizeof *chunks, chunk_cmp);
+
+	*countp = count;
+
+	return chunks;
+}
+
+static void
+stream_error(const char *msg, const char *tmppath)
+{
+	fprintf(stderr, "%s: %s\n", progname, msg);
+	unlink(tmppath);
+	exit(EXIT_STREAM);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char line[512], tmppath[4096], hashbuf[17];
+	char *base, *literal = NULL;
+	struct chunk *chunks, key, *found;
+	size_t baselen, nchunks, len, newlen, written = 0, litsize = 0;
+	uint64_t basedigest, newdigest, digest = REPLICA_FNV_OFFSET;
+	int version;
+	FILE *out;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <database>\n", progname);
+		return EXIT_IO;
+	}
+
+	if (fgets(line, sizeof line, stdin) == NULL ||
+			sscanf(line, "ATHEME-DBSYNC %d %16" SCNx64 " %zu %16" SCNx64, &version, &basedigest, &newlen, &newdigest) != 4 ||
+			version != 1)
+	{
+		fprintf(stderr, "%s: not a replication stream\n", progname);
+		return EXIT_STREAM;
+	}
+
+	base = read_file(argv[1], &baselen);
+
+	if (basedigest != 0 && replica_hash(base ? base : "", baselen, REPLICA_FNV_OFFSET) != basedigest)
+	{
+		fprintf(stderr, "%s: %s is not the copy this stream is based on\n", progname, argv[1]);
+		return EXIT_BASE;
+	}
+
+	chunks = index_chunks(base, baselen, &nchunks);
+
+	snprintf(tmppath, sizeof tmppath, "%s.new", argv[1]);
+
+	if ((out = fopen(tmppath, "wb")) == NULL)
+	{
+		fprintf(stderr, "%s: cannot create %s: %s\n", progname, tmppath, strerror(errno));
+		return EXIT_IO;
+	}
+
+	for (;;)
+	{
+		if (fgets(line, sizeof line, stdin) == NULL)
+			stream_error("stream ended early", tmppath);
+
+		if (!strcmp(line, "E\n"))
+			break;
+
+		if (sscanf(line, "C %16s %zu", hashbuf, &len) == 2)
+		{
+			key.hash = strtoull(hashbuf, NULL, 16);
+			found = nchunks ? bsearch(&key, chunks, nchunks, sizeof *chunks, chunk_cmp) : NULL;
+
+			if (found == NULL || found->len != len)
+				stream_error("stream refers to a chunk this copy does not have", tmppath);
+
+			fwrite(base + found->off, 1, len, out);
+			digest = replica_hash(base + found->off, len, digest);
+		}
+		else if (sscanf(line, "L %zu", &len) == 1)
+		{
+			if (len > litsize)
+				literal = xrealloc(literal, litsize = len);
+
+			if (fread(literal, 1, len, stdin) != len)
+				stream_error("stream ended early", tmppath);
+
+			fwrite(literal, 1, len, out);
+			digest = replica_hash(literal, len, digest);
+		}
+		else
+			stream_error("malformed record in stream", tmppath);
+
+		written += len;
+	}
+
+	if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) != 0 || fclose(out) != 0)
+	{
+		fprintf(stderr, "%s: cannot write %s: %s\n", progname, tmppath, strerror(errno));
+		unlink(tmppath);
+		return EXIT_IO;
+	}
+
+	if (written != newlen || digest != newdigest)
+	{
+		fprintf(stderr, "%s: reassembled copy does not match the stream\n", progname);
+		unlink(tmppath);
+		return EXIT_STREAM;
+	}
+
+	if (rename(tmppath, argv[1]) != 0)
+	{
+		fprintf(stderr, "%s: cannot rename %s to %s: %s\n", progname, tmppath, argv[1], strerror(errno));
+		unlink(tmppath);
+		return EXIT_IO;
+	}
+
+	free(base);
+	free(chunks);
+	free(literal);
+
+	return 0;
+}